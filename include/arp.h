@@ -3,9 +3,26 @@
 #define __ARPH__
 #include "task.h"
 #include "inet.h"
+
+/**
+ * ARP cache table size (must be a power of two).
+ */
+#ifndef ARP_CACHE_SIZE
+#define ARP_CACHE_SIZE        16
+#endif
+
 extern bool_t query_cache(IPV4 *ip, EUI48 *mac);
 extern void update_cache(IPV4 *ip, EUI48 *mac);
+extern bool_t arp_pin(IPV4 *ip);
+extern bool_t arp_entry(byte_t n, IPV4 *ip, EUI48 *mac);
+extern void arp_restore(IPV4 *ip, EUI48 *mac);
+extern bool_t arp_resolve(IPV4 *ip);
 extern void arp_query(IPV4 *ip);
+extern void arp_announce(void);
+extern void arp_probe(IPV4 *ip);
+extern bool_t arp_conflict;
+extern void arp_configured(void);
 extern void arp_mens();
 extern void arp_init();
+extern byte_t arp_tick(byte_t p);
 #endif
@@ -11,6 +11,10 @@ extern chks_t chks;
 
 extern void add_checksum(uint16_t v);
 extern void ip_checksum(buffer_t p, uint16_t t);
+extern void ip_checksum_c(buffer_t p, uint16_t t);
+#ifdef CHECKSUM_45GS02
+extern void ip_checksum_45gs02(buffer_t p, uint16_t t);
+#endif
 #define checksum_init() {chks.u = 0;}
 #define checksum_result() (~chks.u)
 #endif
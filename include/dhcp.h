@@ -1,3 +1,5 @@
 bool_t dhcp_autoconfig(void);
 
 extern unsigned char dhcp_configured;
+extern uint32_t dhcp_lease;
+extern uint32_t dhcp_leased;
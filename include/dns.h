@@ -1,2 +1,19 @@
 
+/*
+ * Cache of resolved names, kept until their TTL runs out.
+ */
+#define DNS_CACHE_SIZE 4
+#define DNS_NAME_MAX 32
+
+typedef struct {
+  char name[DNS_NAME_MAX];              // "" if unused
+  IPV4 ip;
+  uint32_t expires;                     // warmstart_clock() value
+} DNS_CACHE_ENTRY;
+
+extern DNS_CACHE_ENTRY dns_cache[DNS_CACHE_SIZE];
+
 bool_t dns_hostname_to_ip(char *hostname,IPV4 *ip);
+bool_t dns_resolve(char *hostname,task_t done);
+
+extern IPV4 dns_return_ip;
@@ -7,6 +7,32 @@
 #define ETH_RX_BUFFER 0xFFDE800L
 #define ETH_TX_BUFFER 0xFFDE800L
 
+/**
+ * Size of the broadcast/multicast allow-list (broadcast takes one entry).
+ */
+#ifndef ETH_MCAST_MAX
+#define ETH_MCAST_MAX 4
+#endif
+
+/**
+ * Receive statistics.
+ */
+typedef struct {
+   uint16_t rx;                  ///< Frames read from the controller.
+   uint16_t rx_mac;              ///< Dropped: addressed to another host or group.
+   uint16_t rx_type;             ///< Dropped: unsupported ethertype.
+   uint16_t rx_proto;            ///< Dropped: unsupported IP protocol.
+   uint16_t rx_port;             ///< Dropped: no socket on the destination port.
+   uint16_t rx_dup;              ///< Dropped: repeat of a TCP data segment just received.
+   uint16_t rx_ring_full;        ///< Polls that found the RX ring full.
+   uint16_t tx_queued;           ///< Frames that had to wait in the TX queue.
+   uint16_t tx_queue_full;       ///< Frames not sent: TX queue full.
+   uint16_t tx_parked;           ///< Frames that had to wait for ARP.
+   uint16_t tx_park_expired;     ///< Frames dropped: next hop never answered.
+} ETH_STATS;
+
+extern ETH_STATS eth_stats;
+
 extern IPV4 ip_mask;
 extern IPV4 ip_gate;
 extern IPV4 ip_dnsserver;
@@ -15,11 +41,20 @@ void eth_read(buffer_t dest, uint16_t tam);
 void eth_write(buffer_t orig, uint16_t tam);
 void eth_set(byte_t v, uint16_t tam);
 bool_t eth_clear_to_send(void);
+bool_t eth_tx_space(void);
 void eth_drop(void);
 byte_t eth_task(byte_t sig);
+byte_t eth_tx_task(byte_t sig);
 bool_t eth_ip_send(void);
 void eth_arp_send(EUI48 *mac);
+void eth_arp_resolved(IPV4 *ip, EUI48 *mac);
 void eth_packet_send(void);
+bool_t eth_reply(uint16_t len, buffer_t hdr, uint16_t hlen);
+bool_t eth_mcast_add(EUI48 *mac);
+bool_t eth_mcast_remove(EUI48 *mac);
+void eth_promiscuous(bool_t on);
+extern bool_t eth_link_up;
+byte_t eth_link_task(byte_t sig);
 void eth_init(void);
 void eth_disable(void);
 void eth_enable(void);
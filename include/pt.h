@@ -0,0 +1,115 @@
+
+#ifndef __PTH__
+#define __PTH__
+
+#include "task.h"
+#include "weeip.h"
+
+/**
+ * Protothreads: stackless coroutines run by the task scheduler.
+ *
+ * A protothread is an ordinary task whose body sits between PT_BEGIN()
+ * and PT_END().  The PT_WAIT/PT_AWAIT macros return to the scheduler and
+ * resume at the same place the next time the task runs, which is when
+ * pt_wake() is called (typically from a socket callback) or when the
+ * wait times out.
+ *
+ * As with any switch-based coroutine, local variables do not survive a
+ * wait (use static ones), and the waits cannot be used inside a switch
+ * statement of the thread body.
+ *
+ *    static pt_t my_pt;
+ *
+ *    byte_t my_thread(byte_t p)
+ *    {
+ *       PT_BEGIN(&my_pt);
+ *       socket_connect(&ip, 80);
+ *       PT_AWAIT_CONNECT(&my_pt, s, 5000);
+ *       ...
+ *       PT_END(&my_pt);
+ *    }
+ *
+ *    pt_init(&my_pt, my_thread, TASK_APP1);
+ *    socket_set_callback(my_callback);      // calls pt_wake(&my_pt, ev)
+ *    pt_start(&my_pt);
+ */
+typedef struct {
+   uint16_t lc;               ///< Local continuation (source line to resume at).
+   byte_t events;             ///< Socket events received and not yet consumed.
+   bool_t timer;              ///< A timeout is armed.
+   uint32_t deadline;         ///< Value of ticks at which the timeout expires.
+   task_t fun;                ///< Thread body, run as a task.
+   task_id_t id;              ///< Task identifier the thread runs under.
+} pt_t;
+
+/**
+ * Thread body return values.
+ */
+#define PT_WAITING         0
+#define PT_EXITED          1
+#define PT_ENDED           2
+
+/**
+ * Event mask bit for a WEEIP_EVENT.
+ */
+#define PT_EV_BIT(e)       (1 << (e))
+
+#define PT_BEGIN(pt)       switch((pt)->lc) { case 0:
+#define PT_END(pt)         } (pt)->lc = 0; (pt)->timer = FALSE; return PT_ENDED
+
+/**
+ * Leave the thread.  The next run starts from PT_BEGIN() again.
+ */
+#define PT_EXIT(pt)        do { (pt)->lc = 0; (pt)->timer = FALSE; return PT_EXITED; } while(0)
+
+/**
+ * Wait until a condition holds, re-checking it whenever the thread is woken.
+ */
+#define PT_WAIT_UNTIL(pt, c) \
+   do { \
+      (pt)->lc = __LINE__; case __LINE__: \
+      if(!(c)) return PT_WAITING; \
+   } while(0)
+
+/**
+ * Wait until a condition holds, or for at most ms milliseconds.
+ * PT_TIMED_OUT() tells which one happened.
+ */
+#define PT_WAIT_UNTIL_FOR(pt, c, ms) \
+   do { \
+      pt_timer_set(pt, ms); \
+      (pt)->lc = __LINE__; case __LINE__: \
+      if(!(c) && !pt_timer_expired(pt)) return pt_timer_wait(pt); \
+   } while(0)
+
+#define PT_TIMED_OUT(pt)   pt_timer_expired(pt)
+
+/**
+ * Let the rest of the system run for ms milliseconds.
+ */
+#define PT_SLEEP(pt, ms)   PT_WAIT_UNTIL_FOR(pt, 0, ms)
+
+/**
+ * Socket waits, each limited to ms milliseconds.
+ * They also end when the peer disconnects (see PT_DISCONNECTED()).
+ */
+#define PT_AWAIT_CONNECT(pt, s, ms) \
+   PT_WAIT_UNTIL_FOR(pt, ((s)->state == _CONNECT) || PT_DISCONNECTED(pt), ms)
+
+#define PT_AWAIT_DATA(pt, ms) \
+   PT_WAIT_UNTIL_FOR(pt, pt_event(pt, WEEIP_EV_DATA) || PT_DISCONNECTED(pt), ms)
+
+#define PT_AWAIT_SENT(pt, ms) \
+   PT_WAIT_UNTIL_FOR(pt, pt_event(pt, WEEIP_EV_DATA_SENT) || PT_DISCONNECTED(pt), ms)
+
+#define PT_DISCONNECTED(pt) ((pt)->events & PT_EV_BIT(WEEIP_EV_DISCONNECT))
+
+extern void pt_init(pt_t *pt, task_t fun, task_id_t id);
+extern void pt_start(pt_t *pt);
+extern void pt_wake(pt_t *pt, byte_t ev);
+extern bool_t pt_event(pt_t *pt, byte_t ev);
+extern void pt_timer_set(pt_t *pt, uint16_t ms);
+extern bool_t pt_timer_expired(pt_t *pt);
+extern byte_t pt_timer_wait(pt_t *pt);
+
+#endif
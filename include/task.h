@@ -9,26 +9,134 @@
 
 typedef byte_t (*task_t)(byte_t);
 
+/**
+ * Task table: identifier, priority class and profiling name of each
+ * task, in identifier order. The identifiers, and the priority and name
+ * tables in task.c, are all generated from it.
+ */
+#define TASK_TABLE(X) \
+   X(TASK_ETH,          TASK_PRIO_RX,    "eth")       /* eth_task(): ethernet reception. */ \
+   X(TASK_ETH_TX,       TASK_PRIO_TX,    "ethtx")     /* eth_tx_task(): ethernet transmit queue. */ \
+   X(TASK_NWK_UPSTREAM, TASK_PRIO_TX,    "upstream")  /* nwk_upstream(): pending transmissions. */ \
+   X(TASK_NWK_TICK,     TASK_PRIO_TIMER, "nwktick")   /* nwk_tick(): TCP timers. */ \
+   X(TASK_ARP_TICK,     TASK_PRIO_TIMER, "arptick")   /* arp_tick(): ARP cache aging. */ \
+   X(TASK_DHCP_RETRY,   TASK_PRIO_TIMER, "dhcprtry")  /* dhcp_autoconfig_retry(): DHCP retransmission. */ \
+   X(TASK_DNS,          TASK_PRIO_TIMER, "dns")       /* dns_thread(): name resolution. */ \
+   X(TASK_ETH_LINK,     TASK_PRIO_TIMER, "link")      /* eth_link_task(): link state monitoring. */ \
+   X(TASK_WARMSTART,    TASK_PRIO_TIMER, "warmstart") /* warmstart_probe(): check of a restored address. */ \
+   X(TASK_NWK_EVENTS,   TASK_PRIO_APP,   "events")    /* nwk_events(): socket callbacks. */ \
+   X(TASK_APP1,         TASK_PRIO_APP,   "app1")      /* Free for application use. */ \
+   X(TASK_APP2,         TASK_PRIO_APP,   "app2")      /* Free for application use. */ \
+   X(TASK_APP3,         TASK_PRIO_APP,   "app3")      /* Free for application use. */ \
+   X(TASK_APP4,         TASK_PRIO_APP,   "app4")      /* Free for application use. */
+
+#define TASK_ID(id, prio, name)     id,
+
+/**
+ * Task identifiers.
+ * Each identifier owns exactly one scheduler slot, so a task is pending
+ * at most once, and scheduling it can never fail for lack of space.
+ */
+typedef enum {
+   TASK_TABLE(TASK_ID)
+   NTASKS                     ///< Number of task slots.
+} task_id_t;
+
 /**
  * Task structure.
  */
 typedef struct {
    task_t fun;                ///< Task address.
    byte_t par;                ///< Parameter value.
-   byte_t tmr;                ///< Time to wait before calling.
-  char name[8+1];             ///< Name of task
+   byte_t list;               ///< Scheduler list holding the task (TASK_LIST_NONE if idle).
+   byte_t next;               ///< Next task in the same list.
+   byte_t prev;               ///< Previous task in the same list.
+   uint32_t due;              ///< Value of ticks at which the task is due (ms).
 } tid_t;
 
 /**
- * Maximum pending tasks.
+ * Timer wheel size (must be a power of two).
+ * Pending tasks are hashed into a bucket by the low bits of their due time.
+ */
+#define TASK_WHEEL_SIZE    16
+
+/**
+ * Task priority classes, highest first.
+ * Each task identifier has a fixed class; ready tasks of a higher class
+ * always run before those of a lower one.
  */
-#define NTASKS             8
+typedef enum {
+   TASK_PRIO_RX = 0,          ///< Draining the ethernet receive ring.
+   TASK_PRIO_TX,              ///< Sending ACKs and queued data.
+   TASK_PRIO_TIMER,           ///< Protocol timers and housekeeping.
+   TASK_PRIO_APP,             ///< Application tasks.
+   TASK_PRIOS                 ///< Number of priority classes.
+} task_prio_t;
+
+/**
+ * Time low-priority (timer and application) tasks may use in one
+ * task_periodic() pass, in milliseconds.
+ * At least one of them runs per pass; the rest wait for the next one.
+ */
+#ifndef TASK_LOW_BUDGET
+#define TASK_LOW_BUDGET    5
+#endif
+
+/**
+ * Scheduler lists: the wheel buckets, followed by one ready list
+ * per priority class.
+ */
+#define TASK_LIST_READY    TASK_WHEEL_SIZE
+#define TASK_LISTS         (TASK_WHEEL_SIZE+TASK_PRIOS)
+#define TASK_LIST_NONE     0xff
+
+#ifdef TASK_PROFILE
+/**
+ * Run statistics of a task, collected when built with TASK_PROFILE.
+ * Run times are in CIA cycles (about 1us each).
+ */
+typedef struct {
+   uint16_t calls;            ///< Number of times the task ran.
+   uint32_t cycles;           ///< Total time spent in the task.
+   uint32_t max_cycles;       ///< Longest single run.
+   uint16_t max_late;         ///< Largest delay past the due time, in ms.
+} task_profile_t;
+
+/**
+ * Scheduler-wide statistics.
+ */
+extern uint16_t task_profile_add_failed;     ///< task_add() calls rejected.
+extern uint16_t task_profile_rescheduled;    ///< task_add() calls replacing a pending task.
+
+extern task_profile_t *task_profile(task_id_t id);
+extern void task_profile_reset();
+extern void task_profile_dump();
+#endif
+
+/**
+ * Entries in the queue of requests posted from interrupt handlers
+ * (must be a power of two).
+ */
+#define TASK_IRQ_QUEUE     8
+
+/**
+ * Requests dropped because the interrupt queue was full.
+ */
+extern volatile uint16_t task_irq_overflows;
+
+/**
+ * task_idle_time() result when no task is pending at all.
+ */
+#define TASK_IDLE_FOREVER  0xffff
 
 /**
  * Task list.
  */
-extern volatile tid_t _tasks[NTASKS];
+extern tid_t _tasks[NTASKS];
 
+/**
+ * Milliseconds since task_init(), from the CIA 2 timers.
+ */
 extern volatile _uint32_t ticks;
 
 /*
@@ -42,8 +150,15 @@ extern volatile _uint32_t ticks;
 extern void tick();
 extern void task_init();
 extern void task_periodic(void);
-extern bool_t task_add(task_t f, byte_t tempo, byte_t par,char *name);
-extern bool_t task_cancel(task_t f);
+extern bool_t task_add(task_t f, uint16_t tempo, byte_t par, task_id_t id);
+extern bool_t task_ensure(task_t f, uint16_t tempo, byte_t par, task_id_t id);
+extern bool_t task_cancel(task_id_t id);
 extern void task_cancel_all();
+extern void task_sleep(task_t f);
+extern uint16_t task_idle_time();
+extern void task_frame_window(uint16_t first, uint16_t lines);
+extern void task_periodic_frame(void);
+extern bool_t i_task_add(task_t f, uint16_t tempo, byte_t par, task_id_t id);
+extern bool_t i_task_cancel(task_id_t id);
 
 #endif
@@ -0,0 +1,39 @@
+
+#ifndef __WARMSTARTH__
+#define __WARMSTARTH__
+#include "defs.h"
+
+/**
+ * Attic RAM region holding the snapshot of the network state.
+ * Attic RAM keeps its contents from one program run to the next (but not
+ * across power cycles). The region is clear of the ethernet transmit
+ * queue and parking slots.
+ */
+#ifndef WARMSTART_BASE
+#define WARMSTART_BASE  0x8010000L
+#endif
+
+/**
+ * ARP entries kept in the snapshot.
+ */
+#define WARMSTART_ARP   8
+
+/**
+ * Lease time assumed when the DHCP server did not give one, in seconds.
+ */
+#define WARMSTART_LEASE 3600
+
+/**
+ * ARP probes of a restored address, and time between them in
+ * milliseconds, before it is used.
+ */
+#define WARMSTART_PROBES      3
+#define WARMSTART_PROBE_TIME  250
+
+extern bool_t warmstart_pending;
+
+extern uint32_t warmstart_clock(void);
+extern void warmstart_save(void);
+extern bool_t warmstart_restore(void);
+extern byte_t warmstart_probe(byte_t p);
+#endif
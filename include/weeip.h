@@ -43,7 +43,7 @@
 
 #define TIMEOUT_TCP			15
 #define RETRIES_TCP			30
-#define TICK_TCP			   44					// one second
+#define TICK_TCP			   1000					// one second, in milliseconds
 
 /**
  * Communication events reported to socket callbacks.
@@ -105,6 +105,7 @@ typedef struct {
   
   
 	task_t callback;                          ///< Task for socket management.
+	byte_t events;                            ///< Events waiting for the callback, one bit per WEEIP_EVENT.
 	uint16_t port;                            ///< Local port number.
 	uint16_t remPort;                         ///< Remote port number.
 	IPV4 remIP;                               ///< Remote IP address.
@@ -138,6 +139,8 @@ extern void socket_reset();
 extern bool_t socket_disconnect();
 extern void nwk_downstream();
 extern byte_t nwk_upstream(byte_t);
+extern byte_t nwk_events(byte_t);
 extern byte_t nwk_tick(byte_t sig);
+extern void nwk_link_changed(void);
 extern void weeip_init();
 #endif
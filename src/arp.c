@@ -12,7 +12,6 @@
 #include "eth.h"
 
 #include "memory.h"
-#include "random.h"
 
 /********************************************************************************
  ********************************************************************************
@@ -43,6 +42,8 @@
 #include <string.h>
 #include "weeip.h"
 #include "eth.h"
+#include "arp.h"
+#include "warmstart.h"
 
 /*
  * Opcodes.
@@ -56,36 +57,160 @@
 typedef struct {
    IPV4 ip;                                  ///< IP address.
    EUI48 mac;                                ///< Associated MAC address.
-   uint16_t time;                            ///< Time to expire.
+   byte_t state;                             ///< ARP_FREE ... ARP_FAILED.
+   byte_t flags;                             ///< ARP_PINNED, ARP_USED.
+   byte_t used;                              ///< arp_clock at last use, for LRU eviction.
+   byte_t tries;                             ///< Queries sent without an answer.
+   uint16_t time;                            ///< Time to expire, in ARP ticks (REACHABLE, STALE).
+   uint16_t retry;                           ///< ticks (low bits) of the next query, or end of ARP_FAILED.
 } ARP_CACHE_ENTRY;
 
-#define MAX_CACHE             8              ///< ARP Cache table size.
+/*
+ * Entry states.
+ */
+#define ARP_FREE              0
+#define ARP_INCOMPLETE        1              ///< Queried, no answer yet.
+#define ARP_REACHABLE         2              ///< Answered.
+#define ARP_STALE             3              ///< About to expire: still used, and queried again if in use.
+#define ARP_FAILED            4              ///< Did not answer: sends to it fail at once for a while.
+
+#define ARP_PINNED            0x01           ///< Never evicted, refreshed before expiry (gateway, DNS server).
+#define ARP_USED              0x02           ///< Used since it was last answered.
+
+/**
+ * An address hashes to a slot by its low bytes, and may live in any of
+ * the ARP_PROBE slots from there.
+ */
+#define ARP_PROBE             4
+#define ARP_HASH(ip)          (((ip)->b[3] ^ (ip)->b[2]) & (ARP_CACHE_SIZE-1))
 
-#define ARP_TICK_TIME         147            // about 10 seconds
+#define ARP_TICK_TIME         10000          // 10 seconds
 #define MAX_TIMEOUT_ARP       120            // about 20 minutes
-#define MIN_TIMEOUT_ARP       2              // about 20 seconds
+#define STALE_TIMEOUT_ARP     2              // last 20 seconds
+
+/*
+ * Query retransmission: ARP_RETRY_TIME after the first query, doubling
+ * after each one, and giving up after ARP_MAX_TRIES queries.
+ */
+#define ARP_RETRY_TIME        250            // milliseconds
+#define ARP_MAX_TRIES         3
+#define ARP_FAIL_TIME         20000          // milliseconds in ARP_FAILED
+
+#define ARP_NOW               ((uint16_t)ticks.d)
+#define ARP_DUE(t)            ((int16_t)(ARP_NOW - (t)) >= 0)
 
 /**
  * List of known MAC addresses.
  */
-ARP_CACHE_ENTRY arp_cache[MAX_CACHE];
+ARP_CACHE_ENTRY arp_cache[ARP_CACHE_SIZE];
+
+/**
+ * Use counter, stamped into entries as they are used.
+ */
+static byte_t arp_clock;
+
+/**
+ * Value of ticks (low bits) at which entries age next.
+ */
+static uint16_t arp_aged_at;
+
+/**
+ * Address being probed (zero if none), and whether another host was
+ * found using it.
+ */
+static IPV4 arp_probe_ip;
+bool_t arp_conflict;
 
 #define ARP(X) _header.arp.X
 
+/**
+ * Look for an IP in the cache.
+ * @param ip Address to look for.
+ * @return Its entry, or NULL.
+ */
+static ARP_CACHE_ENTRY *
+arp_find
+   (IPV4 *ip)
+{
+   static byte_t n, h;
+
+   h = ARP_HASH(ip);
+   for(n=0;n<ARP_PROBE;n++) {
+      if((arp_cache[h].state != ARP_FREE) && (arp_cache[h].ip.d == ip->d))
+         return &arp_cache[h];
+      h = (h+1) & (ARP_CACHE_SIZE-1);
+   }
+   return NULL;
+}
+
+/**
+ * Start a new (unresolved) cache entry for an IP.
+ * Takes a free slot among those the address may use, or else evicts the
+ * least recently used entry that is not pinned.
+ * @param ip Address.
+ * @return The entry, or NULL if all candidate slots are pinned.
+ */
+static ARP_CACHE_ENTRY *
+arp_new
+   (IPV4 *ip)
+{
+   static byte_t n, h, age, oldest;
+   static ARP_CACHE_ENTRY *e, *victim;
+
+   victim = NULL;
+   oldest = 0;
+   h = ARP_HASH(ip);
+   for(n=0;n<ARP_PROBE;n++) {
+      e = &arp_cache[h];
+      h = (h+1) & (ARP_CACHE_SIZE-1);
+      if(e->flags & ARP_PINNED) continue;
+      if(e->state == ARP_FREE) {
+         victim = e;
+         break;
+      }
+      age = arp_clock - e->used;
+      if((victim == NULL) || (age >= oldest)) {
+         oldest = age;
+         victim = e;
+      }
+   }
+   if(victim == NULL) return NULL;
+
+   victim->ip.d = ip->d;
+   victim->state = ARP_INCOMPLETE;
+   victim->flags = 0;
+   victim->used = arp_clock;
+   victim->tries = 0;
+   return victim;
+}
+
+/**
+ * Send the next query for an entry, and arrange for arp_tick() to
+ * retransmit it.
+ * @param i Cache entry.
+ */
+static void
+arp_send_query
+   (ARP_CACHE_ENTRY *i)
+{
+   arp_query(&i->ip);
+   i->retry = ARP_NOW + (ARP_RETRY_TIME << i->tries);
+   i->tries++;
+   task_ensure(arp_tick, ARP_RETRY_TIME << (i->tries - 1), 0, TASK_ARP_TICK);
+}
+
 /**
  * Search for an IP among the known ones.
- * Starts a new table entry if not found.
  * @param ip Address to look for.
  * @param mac Corresponding MAC address, if found.
- * @return TRUE if found.
+ * @return TRUE if found (see arp_resolve() otherwise).
  */
 bool_t 
 query_cache
    (IPV4 *ip,
    EUI48 *mac)
 {
-   ARP_CACHE_ENTRY *i, *s;
-   byte_t old;
+   ARP_CACHE_ENTRY *i;
    
    /*
     * Checks if broadcast address.
@@ -95,57 +220,45 @@ query_cache
       return TRUE;
    }
 
-   /*
-    * Loops into arp_cache.
-    */
-   for_each(arp_cache, i) {
-      if(i->ip.d == ip->d) {
-         if(i->mac.b[0] == 0xff) return FALSE;
-         memcpy((void*)mac, (void*)&i->mac, sizeof(EUI48));
-#if 0
-	 printf("IP %d.%d.%d.%d is in ARP cache\n",
-		ip->b[0],ip->b[1],ip->b[2],ip->b[3]);
-#endif
-         return TRUE;
-      }
-   }
-#if 0
-   printf("IP %d.%d.%d.%d not in ARP cache\n",
-	  ip->b[0],ip->b[1],ip->b[2],ip->b[3]);
-#endif   
-   /*
-    * Unknown IP.
-    * Look for an empty entry.
-    */
-   old = 0xff;
-   s = arp_cache;
-   for_each(arp_cache, i) {
-      if(i->time <= old) {
-         /*
-          * Search the oldest one, in case we do not find an unused entry.
-          */
-         old = i->time;
-         s = i;
-      }
-      if(old == 0)
-         /*
-          * Done: found an empty entry.
-          */          
-         break;
-   }
+   i = arp_find(ip);
+   if((i == NULL) || ((i->state != ARP_REACHABLE) && (i->state != ARP_STALE)))
+      return FALSE;
+   i->used = ++arp_clock;
+   i->flags |= ARP_USED;
+   memcpy((void*)mac, (void*)&i->mac, sizeof(EUI48));
+   return TRUE;
+}
 
-   /*
-    * Init the entry with the desired IP.
-    */    
-   s->ip.d = ip->d;
-   s->mac.b[0] = 0xff;
-   s->time = MIN_TIMEOUT_ARP;
-   return FALSE;
+/**
+ * Have an address not found by query_cache() resolved.
+ * Sends the first query; retransmissions are paced by arp_tick().
+ * May use _header to build the query.
+ * @param ip Address.
+ * @return FALSE if the address failed to answer recently, so that sends
+ *         to it should fail straight away.
+ */
+bool_t
+arp_resolve
+   (IPV4 *ip)
+{
+   ARP_CACHE_ENTRY *i;
+
+   i = arp_find(ip);
+   if(i == NULL) i = arp_new(ip);
+   if(i == NULL) return FALSE;
+
+   if(i->state == ARP_FAILED) {
+      if(!ARP_DUE(i->retry)) return FALSE;
+      i->state = ARP_INCOMPLETE;
+      i->tries = 0;
+   }
+   if((i->state == ARP_INCOMPLETE) && (i->tries == 0)) arp_send_query(i);
+   return TRUE;
 }
 
 /**
  * Update IP information into the ARP cache.
- * @param ip IP Address, must already be into the cache.
+ * @param ip IP Address, added if not into the cache yet.
  * @param mac MAC address to update.
  */
 void 
@@ -162,28 +275,90 @@ update_cache
 	  );
 #endif
    
-   for_each(arp_cache, i) {
-      if(i->ip.d == ip->d) {
-         memcpy((void*)&i->mac, (void*)mac, sizeof(EUI48));
-         i->time = MAX_TIMEOUT_ARP;
-         return;
-      }
-   }
+   i = arp_find(ip);
+   if(i == NULL) i = arp_new(ip);
+   if(i == NULL) return;
+   memcpy((void*)&i->mac, (void*)mac, sizeof(EUI48));
+   i->state = ARP_REACHABLE;
+   i->flags &= ~ARP_USED;
+   i->tries = 0;
+   i->time = MAX_TIMEOUT_ARP;
+   i->used = ++arp_clock;
+}
+
+/**
+ * Keep an address in the cache for good (gateway, DNS server).
+ * @param ip IP address, on the local network.
+ * @return FALSE if there was no room for it.
+ */
+bool_t 
+arp_pin
+   (IPV4 *ip)
+{
+   ARP_CACHE_ENTRY *i;
 
-   // Not an existing entry in the cache to be updated, so replace a random entry?
-   i = &arp_cache[random32(MAX_CACHE)];
-   i->ip.d = ip->d;
-   memcpy((void*)&i->mac, (void*)mac, sizeof(EUI48));   
-   return;
+   i = arp_find(ip);
+   if(i == NULL) i = arp_new(ip);
+   if(i == NULL) return FALSE;
+   i->flags |= ARP_PINNED;
+   return TRUE;
 }
 
 /**
- * Send a ARP QUERY message to find about an IP address.
- * @param IP address to find.
+ * Read a resolved cache entry (for warmstart_save()).
+ * @param n Entry number, below ARP_CACHE_SIZE.
+ * @param ip IP address of the entry.
+ * @param mac MAC address of the entry.
+ * @return FALSE, leaving ip and mac alone, if the entry is not resolved.
+ */
+bool_t 
+arp_entry
+   (byte_t n,
+   IPV4 *ip,
+   EUI48 *mac)
+{
+   ARP_CACHE_ENTRY *i;
+
+   i = &arp_cache[n];
+   if((i->state != ARP_REACHABLE) && (i->state != ARP_STALE)) return FALSE;
+   ip->d = i->ip.d;
+   memcpy((void*)mac, (void*)&i->mac, sizeof(EUI48));
+   return TRUE;
+}
+
+/**
+ * Put back an entry saved by an earlier run.
+ * It is used right away, but queried again, and forgotten unless it
+ * answers within STALE_TIMEOUT_ARP.
+ * @param ip IP address.
+ * @param mac MAC address.
  */
 void 
-arp_query
-   (IPV4 *ip)
+arp_restore
+   (IPV4 *ip,
+   EUI48 *mac)
+{
+   ARP_CACHE_ENTRY *i;
+
+   update_cache(ip, mac);
+   i = arp_find(ip);
+   if(i == NULL) return;
+   i->state = ARP_STALE;
+   i->flags |= ARP_USED;
+   i->time = STALE_TIMEOUT_ARP;
+   i->tries = 0;
+   i->retry = ARP_NOW;
+   task_ensure(arp_tick, 0, 0, TASK_ARP_TICK);
+}
+
+/**
+ * Send a ARP REQUEST message.
+ * @param ip IP address to find.
+ * @param from Sender IP address (zero for a probe).
+ */
+static void
+arp_request
+   (IPV4 *ip, uint32_t from)
 {
    /*
     * ARP REQUEST message.
@@ -198,7 +373,7 @@ arp_query
     * Local addresses for the Sender.
     */
    memcpy((void*)&ARP(orig_hw), (void*)&mac_local, sizeof(EUI48));
-   ARP(orig_ip).d = ip_local.d;
+   ARP(orig_ip).d = from;
    
    /*
     * Destination addresses.
@@ -212,6 +387,83 @@ arp_query
    eth_arp_send(&ARP(dest_hw));
 }
 
+/**
+ * Send a ARP QUERY message to find about an IP address.
+ * @param IP address to find.
+ */
+void 
+arp_query
+   (IPV4 *ip)
+{
+   arp_request(ip, ip_local.d);
+}
+
+/**
+ * Send a gratuitous ARP request for our own address, so that the hosts
+ * on the segment (and switches) learn where we are.
+ */
+void 
+arp_announce
+   (void)
+{
+   if(ip_local.d == 0) return;                  // not configured yet.
+   arp_query(&ip_local);
+}
+
+/**
+ * Probe an address before taking it (RFC 5227): send a request for it
+ * with no sender address, and watch the traffic for another host using
+ * it. arp_conflict tells if one did.
+ * @param ip Address to probe, or NULL to stop watching.
+ */
+void 
+arp_probe
+   (IPV4 *ip)
+{
+   if(ip == NULL) {
+      arp_probe_ip.d = 0;
+      return;
+   }
+   if(arp_probe_ip.d != ip->d) {
+      arp_probe_ip.d = ip->d;
+      arp_conflict = FALSE;
+   }
+
+   arp_request(ip, 0);
+}
+
+/**
+ * Pin an address and resolve it now, before anything needs it.
+ * @param ip IP address, on the local network.
+ */
+static void
+arp_prewarm
+   (IPV4 *ip)
+{
+   if((ip->d == 0) || (ip->d == 0xffffffff)) return;
+   if(!arp_pin(ip)) return;
+   arp_resolve(ip);
+}
+
+/**
+ * The local address has been set: announce it, and resolve the gateway
+ * and the DNS server (if on the local network) straight away. Both stay
+ * pinned, and are refreshed before they expire. Addresses pinned by an
+ * earlier configuration are released, to age out as usual.
+ */
+void 
+arp_configured
+   (void)
+{
+   ARP_CACHE_ENTRY *i;
+
+   for_each(arp_cache, i) i->flags &= ~ARP_PINNED;
+
+   arp_announce();
+   arp_prewarm(&ip_gate);
+   if(!(ip_mask.d & (ip_dnsserver.d ^ ip_local.d))) arp_prewarm(&ip_dnsserver);
+}
+
 /**
  * Process an incoming ARP message.
  */
@@ -219,7 +471,15 @@ void
 arp_mens
    (void)
 {
-   static EUI48 mac;
+   /*
+    * Address being probed: another host owns it if it sends from it, or
+    * is probing for it at the same time.
+    */
+   if(arp_probe_ip.d
+      && memcmp(&ARP(orig_hw), &mac_local, sizeof(EUI48))
+      && ((ARP(orig_ip).d == arp_probe_ip.d)
+         || ((ARP(opcode) == ARP_REQUEST) && (ARP(orig_ip).d == 0)
+            && (ARP(dest_ip).d == arp_probe_ip.d)))) arp_conflict = TRUE;
 
    /*
     * Check opcode.
@@ -236,8 +496,8 @@ arp_mens
        * Looking for us.
        * Insert sender address into cache.
        */
-      query_cache(&ARP(orig_ip), &mac);
       update_cache(&ARP(orig_ip), &ARP(orig_hw));
+      eth_arp_resolved(&ARP(orig_ip), &ARP(orig_hw));
 
       /*
        * Assemble a response message.
@@ -266,39 +526,113 @@ arp_mens
       eth_arp_send(&ARP(dest_hw));
    } else if(ARP(opcode) == ARP_REPLY) {
       /*
-       * ARP response.
+       * ARP response: only for addresses we asked about.
        */
-      update_cache(&ARP(orig_ip), &ARP(orig_hw));
+      if(arp_find(&ARP(orig_ip))) {
+         update_cache(&ARP(orig_ip), &ARP(orig_hw));
+         eth_arp_resolved(&ARP(orig_ip), &ARP(orig_hw));
+      }
    }
 }
 
 /**
  * ARP timing control task.
- * Called each 10 seconds.
+ * Ages the entries every ARP_TICK_TIME, and retransmits queries in
+ * between as needed.
  */
 byte_t 
 arp_tick
    (byte_t p)
 {
-   ARP_CACHE_ENTRY *i;
+   static ARP_CACHE_ENTRY *i;
+   static bool_t age;
+   static uint16_t wait, left;
+
+   age = ARP_DUE(arp_aged_at);
+   if(age) {
+      arp_aged_at = ARP_NOW + ARP_TICK_TIME;
+      warmstart_save();
+   }
+   wait = arp_aged_at - ARP_NOW;
 
    for_each(arp_cache, i) {
-      if(i->time) {
-         i->time--;
-         if(i->time == 0) {
+      switch(i->state) {
+         case ARP_REACHABLE:
+         case ARP_STALE:
+            if(age) {
+               i->time--;
+               if(i->time == 0) {
+                  if(i->flags & ARP_PINNED) {
+                     /*
+                      * Refresh went unanswered: resolve from scratch.
+                      */
+                     i->state = ARP_INCOMPLETE;
+                     i->tries = 0;
+                     i->retry = ARP_NOW;
+                     break;
+                  }
+                  /*
+                   * Entry too old, remove it.
+                   */
+                  i->state = ARP_FREE;
+                  i->flags = 0;
+                  continue;
+               }
+               if((i->state == ARP_REACHABLE) && (i->time <= STALE_TIMEOUT_ARP)) {
+                  /*
+                   * Query it again before it expires, if it is pinned
+                   * or in use.
+                   */
+                  i->state = ARP_STALE;
+                  i->tries = (i->flags & (ARP_PINNED|ARP_USED)) ? 0 : ARP_MAX_TRIES;
+                  i->retry = ARP_NOW;
+               }
+            }
+            if((i->state == ARP_REACHABLE) || (i->tries >= ARP_MAX_TRIES)) continue;
+            break;
+
+         case ARP_INCOMPLETE:
+            break;
+
+         case ARP_FAILED:
+            if(!ARP_DUE(i->retry)) continue;
+            if(!(i->flags & ARP_PINNED)) {
+               i->state = ARP_FREE;
+               i->flags = 0;
+               continue;
+            }
             /*
-             * Entry too old, remove it.
+             * Pinned entries are never forgotten: start over.
              */
-            memset((void*)i, 0xff, sizeof(ARP_CACHE_ENTRY));
-            i->time = 0;
+            i->state = ARP_INCOMPLETE;
+            i->tries = 0;
+            break;
+
+         default:
+            continue;
+      }
+
+      /*
+       * Query pending: retransmit, or give up.
+       */
+      if(ARP_DUE(i->retry)) {
+         if(i->tries >= ARP_MAX_TRIES) {
+            i->state = ARP_FAILED;
+            i->retry = ARP_NOW + ARP_FAIL_TIME;
+            continue;
          }
-      }      
+         arp_query(&i->ip);
+         i->retry = ARP_NOW + (ARP_RETRY_TIME << i->tries);
+         i->tries++;
+      }
+      left = i->retry - ARP_NOW;
+      if(left < wait) wait = left;
    }
 
    /*
     * Reschedule for periodic execution.
     */
-   task_add(arp_tick, ARP_TICK_TIME, 0,"arptick");
+   task_add(arp_tick, wait, 0, TASK_ARP_TICK);
    return 0;
 }
 
@@ -312,7 +646,10 @@ arp_init
    ARP_CACHE_ENTRY *i;
    memset((void*)&arp_cache, 0xff, sizeof(arp_cache));
    for_each(arp_cache, i) {
-      i->time = 0;
+      i->state = ARP_FREE;
+      i->flags = 0;
    }
-   task_add(arp_tick, ARP_TICK_TIME, 0,"arptick");
+   arp_clock = 0;
+   arp_aged_at = ARP_NOW + ARP_TICK_TIME;
+   task_add(arp_tick, ARP_TICK_TIME, 0, TASK_ARP_TICK);
 }
@@ -79,13 +79,14 @@ add_checksum
 /**
  * Calculate checksum for a memory area (must be word-aligned).
  * Pad a zero byte, if the size is odd.
+ * Portable C version, used when the 45GS02 kernel is not built.
  * Optimized for 8-bit word processors.
  * The result is found in chks.
  * @param p Pointer to a memory buffer.
  * @param t Data size in bytes.
  */
 void 
-ip_checksum
+ip_checksum_c
    (buffer_t p,
    uint16_t t)
 {
@@ -130,3 +131,23 @@ ip_checksum
      if(!chks.b[0]) chks.b[1]++;
    }
 }
+
+/**
+ * Calculate checksum for a memory area.
+ * Uses the 45GS02 Q-register kernel (checksum_45gs02.s) when built with
+ * CHECKSUM_45GS02, and the C version otherwise.
+ * The result is found in chks.
+ * @param p Pointer to a memory buffer.
+ * @param t Data size in bytes.
+ */
+void 
+ip_checksum
+   (buffer_t p,
+   uint16_t t)
+{
+#ifdef CHECKSUM_45GS02
+   ip_checksum_45gs02(p, t);
+#else
+   ip_checksum_c(p, t);
+#endif
+}
@@ -0,0 +1,196 @@
+;
+; @file checksum_45gs02.s
+; @brief IP checksum kernel for the MEGA65 45GS02, using the 32-bit Q register.
+; @compiler CA65
+; @author Paul Gardner-Stephen (paul@m-e-g-a.org)
+;
+; void __fastcall__ ip_checksum_45gs02(buffer_t p, uint16_t t);
+;
+; Drop-in replacement for ip_checksum_c(): adds the t bytes at p into chks.
+; The buffer is summed as little-endian 32-bit words with ADCQ, letting the
+; carry of each add ripple into the next one (end-around carry), and the
+; result is folded back to 16 bits at the end.  The one's complement sum is
+; byte-order independent, so the folded little-endian result has exactly the
+; same byte layout as chks (even bytes in chks.b[0], odd bytes in chks.b[1]).
+;
+
+	.setcpu		"4510"
+
+	.export		_ip_checksum_45gs02
+	.import		_chks
+	.import		popax
+	.importzp	ptr1, ptr2, tmp1, tmp2
+
+;
+; NEG NEG prefixes the next A instruction, making it operate on
+; Q = Z:Y:X:A.  CA65 does not know the Q instructions, so they are
+; assembled by hand.
+;
+.macro	q_prefix
+	.byte	$42, $42
+.endmacro
+
+.macro	ldq_abs	addr
+	q_prefix
+	.byte	$ad
+	.word	addr
+.endmacro
+
+.macro	stq_abs	addr
+	q_prefix
+	.byte	$8d
+	.word	addr
+.endmacro
+
+.macro	adcq_abs addr
+	q_prefix
+	.byte	$6d
+	.word	addr
+.endmacro
+
+;
+; ADCQ (zp).  Z is part of Q, so this form is not indexed by Z.
+;
+.macro	adcq_ind zp
+	q_prefix
+	.byte	$72, zp
+.endmacro
+
+;
+; Advance the data pointer by one 32-bit word.
+; INW leaves the carry alone, so the end-around carry survives.
+;
+.macro	next_word
+	inw	ptr1
+	inw	ptr1
+	inw	ptr1
+	inw	ptr1
+.endmacro
+
+	.bss
+
+acc:	.res	4			; 32-bit running sum
+tail:	.res	4			; last 1-3 bytes, zero padded
+
+	.code
+
+_ip_checksum_45gs02:
+	;
+	; ptr2 = number of 16 byte blocks,
+	; tmp2 = number of remaining 32-bit words + 1,
+	; tmp1 = number of remaining bytes.
+	;
+	sta	ptr2
+	stx	ptr2+1
+	and	#$0f
+	tax
+	and	#$03
+	sta	tmp1
+	txa
+	lsr	a
+	lsr	a
+	sta	tmp2
+	inc	tmp2
+	ldx	#4
+@div16:	lsr	ptr2+1
+	ror	ptr2
+	dex
+	bne	@div16
+
+	jsr	popax
+	sta	ptr1
+	stx	ptr1+1
+
+	;
+	; Seed the sum with the current checksum, so that
+	; consecutive calls chain exactly like the C version.
+	;
+	lda	#0
+	sta	acc+2
+	sta	acc+3
+	sta	tail
+	sta	tail+1
+	sta	tail+2
+	sta	tail+3
+	lda	_chks
+	sta	acc
+	lda	_chks+1
+	sta	acc+1
+
+	lda	ptr2
+	ora	ptr2+1
+	bne	@blocks
+	ldq_abs	acc
+	clc
+	bra	@words
+
+	;
+	; Main loop, unrolled to 16 bytes per iteration.
+	; Only INW/DEW/branches touch the flags between the adds.
+	;
+@blocks:
+	ldq_abs	acc
+	clc
+@block:	adcq_ind ptr1
+	next_word
+	adcq_ind ptr1
+	next_word
+	adcq_ind ptr1
+	next_word
+	adcq_ind ptr1
+	next_word
+	dew	ptr2
+	bne	@block
+
+	;
+	; Up to three remaining 32-bit words.
+	;
+@words:	dec	tmp2
+	beq	@tail
+	adcq_ind ptr1
+	next_word
+	bra	@words
+
+	;
+	; Up to three remaining bytes, added as one zero-padded word.
+	;
+@tail:	stq_abs	acc
+	php				; keep the pending carry
+	ldy	#0
+	ldx	tmp1
+	beq	@addtail
+@copy:	lda	(ptr1),y
+	sta	tail,y
+	iny
+	dex
+	bne	@copy
+@addtail:
+	plp
+	ldq_abs	acc
+	adcq_abs tail
+	stq_abs	acc
+
+	;
+	; Fold 32 -> 16 bits, then wrap carries around until none is left.
+	;
+	lda	acc
+	adc	acc+2
+	sta	acc
+	lda	acc+1
+	adc	acc+3
+	sta	acc+1
+@fold:	lda	acc
+	adc	#0
+	sta	acc
+	lda	acc+1
+	adc	#0
+	sta	acc+1
+	bcs	@fold
+
+	lda	acc
+	sta	_chks
+	lda	acc+1
+	sta	_chks+1
+
+	ldz	#0			; everything else expects Z = 0
+	rts
@@ -5,16 +5,17 @@
 #include "arp.h"
 #include "dns.h"
 #include "dhcp.h"
+#include "warmstart.h"
 
 #include "memory.h"
 #include "random.h"
 
-// Don't request DHCP retries too quickly
-// as the network tick loop may be called
-// very fast during configuration
-#define DHCP_RETRY_TICKS 255
+// Time between DHCP retries, in milliseconds
+#define DHCP_RETRY_TICKS 4000
 
 unsigned char dhcp_configured=0,dhcp_acks=0;
+uint32_t dhcp_lease=0;                     // Lease time offered, in seconds (0 if none)
+uint32_t dhcp_leased=0;                    // warmstart_clock() when configured
 unsigned char dhcp_xid[4]={0};
 
 extern IPV4 ip_broadcast;                  ///< Subnetwork broadcast address
@@ -28,6 +29,18 @@ SOCKET *dhcp_socket;
 
 void dhcp_send_query_or_request(unsigned char requestP);
 
+// Configuration complete: free the socket, announce ourselves and have
+// the gateway and DNS server resolved before the first connection, and
+// keep the configuration for the next run.
+static void dhcp_done(void)
+{
+  dhcp_configured=1;
+  dhcp_leased=warmstart_clock();
+  socket_release(dhcp_socket);
+  arp_configured();
+  warmstart_save();
+}
+
 byte_t dhcp_reply_handler (byte_t p)
 {
   unsigned int type,len,offset;
@@ -106,6 +119,13 @@ byte_t dhcp_reply_handler (byte_t p)
 	    for(i=0;i<4;i++) ip_dnsserver.b[i] = dns_buf[offset+i];	  
 #ifdef DEBUG_DHCP
 	    printf("DNS option is %d.%d.%d.%d\n",ip_dnsserver.b[0],ip_dnsserver.b[1],ip_dnsserver.b[2],ip_dnsserver.b[3]);
+#endif
+	    break;
+	  case 0x33:
+	    dhcp_lease=0;
+	    for(i=0;i<4;i++) dhcp_lease=(dhcp_lease<<8)|dns_buf[offset+i];
+#ifdef DEBUG_DHCP
+	    printf("Lease time is %lu seconds\n",dhcp_lease);
 #endif
 	    break;
 	  default:
@@ -131,18 +151,14 @@ byte_t dhcp_reply_handler (byte_t p)
       // Fritz box only sends DHCP ACK, not message type 5, so we just give up
       // after a couple of goes
       dhcp_acks++;
-      if (dhcp_acks>2) {
-	dhcp_configured=1;
-	socket_release(dhcp_socket);
-      }
+      if (dhcp_acks>2) dhcp_done();
 
     } else if (dns_buf[0xf2]==0x05) {
       // Mark DHCP configuration complete, and free the socket
-      dhcp_configured=1;
 #ifdef DEBUG_DHCP
       printf("DHCP configuration complete.\n");
 #endif
-      socket_release(dhcp_socket);
+      dhcp_done();
     } else {
 #ifdef DEBUG_DHCP
       printf("Unknown DHCP message\n");
@@ -161,7 +177,7 @@ byte_t dhcp_autoconfig_retry(byte_t b)
     
     // This will automatically re-add us to the list
     dhcp_send_query_or_request(0);
-    task_add(dhcp_autoconfig_retry, DHCP_RETRY_TICKS, 0,"dhcprtry");
+    task_add(dhcp_autoconfig_retry, DHCP_RETRY_TICKS, 0, TASK_DHCP_RETRY);
   }
   return 0;
 }
@@ -169,6 +185,9 @@ byte_t dhcp_autoconfig_retry(byte_t b)
 bool_t dhcp_autoconfig(void)
 { 
   if (dhcp_configured) return 1;
+  // A restored configuration is being checked: warmstart_probe() calls
+  // us again if its address turns out to be taken.
+  if (warmstart_pending) return 0;
 
   // Initially we have seen zero DHCP acks
   dhcp_acks=0;
@@ -183,7 +202,7 @@ bool_t dhcp_autoconfig(void)
   dhcp_configured=0;
 
   // Schedule ourselves to retransmit DHCP query until we are configured
-  task_add(dhcp_autoconfig_retry, DHCP_RETRY_TICKS, 0,"dhcprtry");
+  task_add(dhcp_autoconfig_retry, DHCP_RETRY_TICKS, 0, TASK_DHCP_RETRY);
   
   
 }
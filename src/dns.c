@@ -5,10 +5,16 @@
 #include "eth.h"
 #include "arp.h"
 #include "dns.h"
+#include "pt.h"
+#include "warmstart.h"
 
 #include "memory.h"
 #include "random.h"
 
+// Resolution gives up after this many queries, one every DNS_RETRY_TIME ms
+#define DNS_RETRIES 30
+#define DNS_RETRY_TIME 1000
+
 unsigned char dns_query_returned=0;
 IPV4 dns_return_ip;
 SOCKET *dns_socket;
@@ -16,6 +22,60 @@ unsigned char dns_query[512];
 uint16_t dns_query_len=0;
 unsigned char dns_buf[512];
 
+static pt_t dns_pt;
+static bool_t dns_busy=FALSE;
+static byte_t dns_retries;
+static task_t dns_done;
+static byte_t dns_blocking_result;
+
+DNS_CACHE_ENTRY dns_cache[DNS_CACHE_SIZE];
+static char dns_name[DNS_NAME_MAX];     // Name being resolved, "" if too long to cache
+static uint32_t dns_ttl;
+
+/*
+ * Look for an unexpired answer in the cache.
+ */
+static bool_t dns_cache_lookup(char *hostname,IPV4 *ip)
+{
+  static byte_t i;
+  static uint32_t now;
+
+  now=warmstart_clock();
+  for(i=0;i<DNS_CACHE_SIZE;i++) {
+    if (!dns_cache[i].name[0]) continue;
+    if (strcmp(dns_cache[i].name,hostname)) continue;
+    if (dns_cache[i].expires<=now) return 0;
+    ip->d=dns_cache[i].ip.d;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Remember the answer in dns_return_ip for dns_ttl seconds, replacing
+ * the same name, an unused or expired entry, or else the one that
+ * expires first.
+ */
+static void dns_cache_add(void)
+{
+  static byte_t i, e;
+  static uint32_t now;
+
+  if ((!dns_name[0])||(!dns_ttl)) return;
+  now=warmstart_clock();
+  e=0;
+  for(i=0;i<DNS_CACHE_SIZE;i++) {
+    if (!strcmp(dns_cache[i].name,dns_name)) { e=i; break; }
+    if ((!dns_cache[i].name[0])||(dns_cache[i].expires<=now)) e=i;
+    else if (dns_cache[e].name[0]&&(dns_cache[e].expires>now)
+             &&(dns_cache[i].expires<dns_cache[e].expires)) e=i;
+  }
+  strcpy(dns_cache[e].name,dns_name);
+  dns_cache[e].ip.d=dns_return_ip.d;
+  dns_cache[e].expires=now+dns_ttl;
+  warmstart_save();
+}
+
 void dns_construct_hostname_to_ip_query(char *hostname)
 {  
   unsigned char prefix_position,i;
@@ -147,13 +207,16 @@ byte_t dns_reply_handler (byte_t p)
 	      // Then we check that answer class is $00 $01 = "IPv4 address"
 	      if ((dns_buf[ofs]==0x00)&&(dns_buf[ofs+1]==0x01)) {
 		ofs+=2;
-		// Now we can just skip over the TTL and size, by assuming its a 4 byte
+		// TTL, then skip over the size, by assuming its a 4 byte
+		dns_ttl=0;
+		for(i=0;i<4;i++) dns_ttl=(dns_ttl<<8)|dns_buf[ofs+i];
 		ofs+=6;
 		// IP address
 		dns_return_ip.b[0]=dns_buf[ofs+0];
 		dns_return_ip.b[1]=dns_buf[ofs+1];
 		dns_return_ip.b[2]=dns_buf[ofs+2];
 		dns_return_ip.b[3]=dns_buf[ofs+3];
+		if (!dns_query_returned) dns_cache_add();
 		dns_query_returned=1;
 		break;
 	      }
@@ -164,6 +227,7 @@ byte_t dns_reply_handler (byte_t p)
     
     break;
   }
+  if (dns_query_returned) pt_wake(&dns_pt,WEEIP_EV_DATA);
   return 0;
 }
 
@@ -171,12 +235,12 @@ unsigned char offset=0;
 unsigned char bytes=0;
 unsigned char value=0;
 
-bool_t dns_hostname_to_ip(char *hostname,IPV4 *ip)
+/*
+ * Parse a dotted-quad IP address.
+ * Returns 0 if the hostname is not one.
+ */
+static bool_t dns_parse_ip(char *hostname,IPV4 *ip)
 {
-  EUI48 mac;
-  unsigned char next_retry,retries;
-
-  // Check if IP address, and if so, parse directly.
   offset=0; bytes=0; value=0;
   while(hostname[offset]) {
     if (hostname[offset]=='.') {
@@ -191,52 +255,87 @@ bool_t dns_hostname_to_ip(char *hostname,IPV4 *ip)
     offset++;
   }
   if (bytes==3&&(!hostname[offset])) {ip->b[3]=value; return 1; }
-  
+  return 0;
+}
+
+/*
+ * Resolver thread: send the query, and resend it every DNS_RETRY_TIME ms
+ * until the reply handler has seen an answer, or we run out of retries.
+ */
+byte_t dns_thread(byte_t p)
+{
+  PT_BEGIN(&dns_pt);
+
+  // The DNS server (or the gateway) is resolved in advance by
+  // arp_configured(), and the first query waits for ARP if need be.
+  socket_select(dns_socket);
+  socket_connect(&ip_dnsserver,53);
+
+  for(dns_retries=DNS_RETRIES;dns_retries;dns_retries--) {
+    socket_select(dns_socket);
+    socket_send(dns_query,dns_query_len);
+    PT_WAIT_UNTIL_FOR(&dns_pt,dns_query_returned,DNS_RETRY_TIME);
+    if (dns_query_returned) break;
+  }
+
+  socket_release(dns_socket);
+  dns_busy=FALSE;
+  (*dns_done)(dns_query_returned);
+
+  PT_END(&dns_pt);
+}
+
+/*
+ * Start resolving a hostname without waiting for the answer.
+ * done is called with 1 when the address is in dns_return_ip, or
+ * with 0 if resolution failed.
+ * Returns 0 if another resolution is still in progress.
+ */
+bool_t dns_resolve(char *hostname,task_t done)
+{
+  if (dns_busy) return 0;
+
+  dns_done=done;
+  if (dns_parse_ip(hostname,&dns_return_ip)
+      ||dns_cache_lookup(hostname,&dns_return_ip)) {
+    (*done)(1);
+    return 1;
+  }
+  if (strlen(hostname)<DNS_NAME_MAX) strcpy(dns_name,hostname);
+  else dns_name[0]=0;
+
   dns_socket = socket_create(SOCKET_UDP);
+  if (!dns_socket) return 0;
   socket_set_callback(dns_reply_handler);
   socket_set_rx_buffer(dns_buf,sizeof dns_buf);
-  
-  // Before we get any further, send an ARP query for the DNS server
-  // (or if it isn't on the same network segment, for our gateway.)
-  // to prime things.
-  // XXX Should not be necessary, as it will happen automatically?
-  //  arp_query(&ip_dnsserver);
-  //  arp_query(&ip_gate);
-  // Then wait until we get a reply.
-  //  while((!query_cache(&ip_dnsserver,&mac)) &&(!query_cache(&ip_gate,&mac)) ) {
-  //    task_periodic();     
-  //  }
-  //  printf("ARPed");
-  
-  socket_select(dns_socket);
-  socket_connect(&ip_dnsserver,53);
 
   dns_construct_hostname_to_ip_query(hostname);
+  dns_query_returned=0;
+  dns_busy=TRUE;
 
-  socket_send(dns_query,dns_query_len);
+  pt_init(&dns_pt,dns_thread,TASK_DNS);
+  pt_start(&dns_pt);
+  return 1;
+}
 
-  // Run normal network state machine
-  // XXX Call-back handlers for other network tasks can still occur
-  dns_query_returned=0;
+static byte_t dns_blocking_done(byte_t ok)
+{
+  dns_blocking_result=ok?1:2;
+  return 0;
+}
 
-  // Retry for approx 30 seconds (will be slightly longer on NTSC, as we
-  // time retries based on elapsed video frames).
-  retries=30;
-  next_retry=PEEK(0xD7FA)+50;
-  
-  while(!dns_query_returned) {
-    task_periodic();
-
-    // Detect timeout, and retry for ~30 seconds
-    if (PEEK(0xD7FA)==next_retry) {
-      if (!retries) return 0;
-      socket_select(dns_socket);
-      socket_send(dns_query,dns_query_len);
-      retries--;
-      next_retry=PEEK(0xD7FA)+50;
-    }
+/*
+ * Resolve a hostname, running the network until the answer is in.
+ * Other tasks keep running meanwhile.
+ */
+bool_t dns_hostname_to_ip(char *hostname,IPV4 *ip)
+{
+  if (dns_parse_ip(hostname,ip)) return 1;
 
-  }
+  dns_blocking_result=0;
+  if (!dns_resolve(hostname,dns_blocking_done)) return 0;
+  while(!dns_blocking_result) task_periodic();
+  if (dns_blocking_result!=1) return 0;
 
   // Copy resolved IP address
   ip->b[0]=dns_return_ip.b[0];
@@ -244,7 +343,5 @@ bool_t dns_hostname_to_ip(char *hostname,IPV4 *ip)
   ip->b[2]=dns_return_ip.b[2];
   ip->b[3]=dns_return_ip.b[3];
 
-  socket_release(dns_socket);
-
   return 1;
 }
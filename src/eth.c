@@ -21,11 +21,30 @@
 #include "debug.h"
 #include "time.h"
 
-#define _PROMISCUOUS
+// Wake the RX task from the controller's RX interrupt when ETH_RX_IRQ is
+// defined project-wide (see TCPDEFS in the Makefile); polling stays as a
+// slow fallback.
+#if defined(ETH_RX_IRQ) && defined(__CC65__)
+#include <6502.h>
+#define ETH_IRQ_STACK 128
+static unsigned char eth_irq_stack[ETH_IRQ_STACK];
+static bool_t eth_irq_installed=FALSE;
+#else
+#undef ETH_RX_IRQ
+#endif
+
+// Start in promiscuous mode, i.e. have the controller pass every frame
+// on the segment (for capturing with ETH_LOG_RX). See eth_promiscuous().
+//#define _PROMISCUOUS
 
 #define NOCRCCHECK
 
-static unsigned char eth_log_mode=0;
+// Keep a near copy of every transmitted frame, so that ETH_LOG_TX can
+// show it (costs 2KB of RAM; frames are otherwise written straight into
+// the controller's TX buffer).
+//#define ETH_TX_MIRROR
+
+unsigned char eth_log_mode=0;
 
 static uint16_t eth_size;        // Packet size.
 uint16_t eth_tx_len=0;           // Bytes written to TX buffer
@@ -45,9 +64,92 @@ typedef struct {
 } ETH_HEADER;
 
 /**
- * Ethernet frame header buffer.
+ * Parse area: the start of the received frame, read with a single DMA job.
+ */
+#define ETH_RX_BURST 64
+static union {
+   byte_t b[ETH_RX_BURST];
+   struct {
+      uint16_t flags;            ///< Frame length and flags from the controller.
+      ETH_HEADER eth;            ///< Ethernet header.
+      HEADER net;                ///< Network and transport headers.
+   } f;
+} rx_burst;
+
+#define eth_header rx_burst.f.eth
+
+/**
+ * Early receive filter: ethertypes and IP protocols we handle
+ * (big-endian ethertypes).
+ */
+static const uint16_t eth_rx_types[] = { 0x0608, 0x0008 };      // ARP, IP
+static const byte_t eth_rx_protos[] = { IP_PROTO_UDP, IP_PROTO_TCP, IP_PROTO_ICMP };
+
+/**
+ * Receive address filter ($D6E5 bits).
+ * Outside promiscuous mode the controller only passes frames for our MAC
+ * address, and broadcast or multicast frames if enabled; those are only
+ * enabled while the allow-list holds such an address, and eth_rx_filter()
+ * checks the group address against the list.
+ */
+#define ETH_NOPROM      0x01
+#define ETH_BCST        0x10
+#define ETH_MCST        0x20
+
+static EUI48 eth_mcast[ETH_MCAST_MAX];
+static byte_t eth_mcast_count=0;
+#if defined(_PROMISCUOUS)
+static bool_t eth_promisc=TRUE;
+#else
+static bool_t eth_promisc=FALSE;
+#endif
+
+/**
+ * Receive statistics.
+ */
+ETH_STATS eth_stats;
+
+/*
+ * Transmit queue.
+ * Frames built while the controller is still sending wait here, in far
+ * memory, and eth_tx_task() moves them to the TX buffer one at a time as
+ * the TX-ready bit comes back. Otherwise frames are built directly in the
+ * TX buffer.
+ */
+#ifndef ETH_TXQ_BASE
+#define ETH_TXQ_BASE    0x8000000L      // Attic RAM
+#endif
+#define ETH_TXQ_SLOTS   4               // Must be a power of two
+#define ETH_TXQ_SLOT    2048L
+
+static uint16_t eth_txq_len[ETH_TXQ_SLOTS];
+static byte_t eth_txq_head=0;
+static byte_t eth_txq_count=0;
+static uint32_t eth_tx_dest=ETH_TX_BUFFER;     // Where the current frame is built
+
+/*
+ * Frames waiting for ARP.
+ * An IP frame whose next hop is not in the ARP cache yet is built in one
+ * of these slots (after the transmit queue) with a blank destination
+ * address, and sent as soon as eth_arp_resolved() learns the address.
+ * Frames still waiting after ETH_PARK_TIMEOUT milliseconds are dropped
+ * (never sent late, when the sender's own retransmission has taken over)
+ * by eth_park_expire().
  */
-ETH_HEADER eth_header;
+#define ETH_PARK_SLOTS  4
+#define ETH_PARK_BASE   (ETH_TXQ_BASE+ETH_TXQ_SLOT*ETH_TXQ_SLOTS)
+#define ETH_PARK_TIMEOUT 2000
+
+#define ETH_PARK_FREE   0
+#define ETH_PARK_WAIT   1               // Next hop unresolved
+#define ETH_PARK_READY  2               // Address filled in, to be sent
+
+static byte_t eth_park_state[ETH_PARK_SLOTS];
+static IPV4 eth_park_hop[ETH_PARK_SLOTS];
+static uint16_t eth_park_len[ETH_PARK_SLOTS];
+static uint32_t eth_park_time[ETH_PARK_SLOTS];   // ticks when parked
+static byte_t eth_park_ready=0;                  // Slots in ETH_PARK_READY
+static byte_t eth_park_slot=0xff;                // Slot of the frame being built
 
 /**
  * Local MAC address.
@@ -55,12 +157,26 @@ ETH_HEADER eth_header;
 EUI48 mac_local;
 
 #define MTU 2048
+#ifdef ETH_TX_MIRROR
 unsigned char tx_frame_buf[MTU];
+#endif
 
-void eth(uint8_t b)
+/*
+ * Headers of the frame being built: ethernet header, then the IP and
+ * TCP/UDP headers or the ARP message, so they reach the TX buffer in one
+ * DMA job.
+ */
+static byte_t tx_hdr[14+40];
+
+/*
+ * Fill in the ethernet header in tx_hdr.
+ */
+static void eth_header_set(EUI48 *mac,uint8_t type_lo)
 {
-  if (eth_tx_len<MTU) tx_frame_buf[eth_tx_len]=b;
-  eth_tx_len++;
+  memcpy(&tx_hdr[0],mac,6);
+  memcpy(&tx_hdr[6],&mac_local,6);
+  tx_hdr[12]=0x08;
+  tx_hdr[13]=type_lo;
 }
 
 /*
@@ -76,6 +192,153 @@ eth_clear_to_send()
   return FALSE;
 }
 
+/**
+ * Check if a frame can be built now, either in the TX buffer or in the
+ * transmit queue.
+ * @return TRUE if eth_ip_send()/eth_arp_send() have room.
+ */
+bool_t
+eth_tx_space()
+{
+  if (eth_txq_count<ETH_TXQ_SLOTS) return TRUE;
+  return FALSE;
+}
+
+/**
+ * Choose where the next frame is built: straight in the TX buffer if the
+ * controller is idle and nothing is queued, else in a free queue slot.
+ * @return FALSE if the queue is full.
+ */
+static bool_t eth_tx_begin(void)
+{
+  eth_tx_len=0;
+  eth_park_slot=0xff;
+  if ((!eth_txq_count)&&(!eth_park_ready)&&eth_clear_to_send()) {
+    eth_tx_dest=ETH_TX_BUFFER;
+    return TRUE;
+  }
+  if (eth_txq_count==ETH_TXQ_SLOTS) {
+    eth_stats.tx_queue_full++;
+    return FALSE;
+  }
+  eth_tx_dest=ETH_TXQ_BASE+ETH_TXQ_SLOT*((eth_txq_head+eth_txq_count)&(ETH_TXQ_SLOTS-1));
+  return TRUE;
+}
+
+/**
+ * Start transmission of the frame in the TX buffer.
+ */
+static void eth_tx_start(uint16_t len)
+{
+  // Set packet length
+  mega65_io_enable();
+  POKE(0xD6E2,len&0xff);
+  POKE(0xD6E3,len>>8);
+
+  // Make sure ethernet is not under reset
+  POKE(0xD6E0,0x03);
+
+  // Send packet
+  POKE(0xD6E4,0x01); // TX now
+}
+
+/**
+ * Ethernet transmit queue task.
+ * Sends the oldest queued frame when the controller is ready, then the
+ * frames whose next hop has been resolved.
+ */
+uint8_t eth_tx_task (uint8_t p)
+{
+  static byte_t i;
+
+  if ((!eth_txq_count)&&(!eth_park_ready)) return 0;
+  if (eth_clear_to_send()) {
+    if (eth_txq_count) {
+      lcopy(ETH_TXQ_BASE+ETH_TXQ_SLOT*eth_txq_head,ETH_TX_BUFFER,eth_txq_len[eth_txq_head]);
+      eth_tx_start(eth_txq_len[eth_txq_head]);
+      eth_txq_head=(eth_txq_head+1)&(ETH_TXQ_SLOTS-1);
+      eth_txq_count--;
+    } else {
+      for(i=0;eth_park_state[i]!=ETH_PARK_READY;i++) continue;
+      lcopy(ETH_PARK_BASE+ETH_TXQ_SLOT*i,ETH_TX_BUFFER,eth_park_len[i]);
+      eth_tx_start(eth_park_len[i]);
+      eth_park_state[i]=ETH_PARK_FREE;
+      eth_park_ready--;
+    }
+  }
+  // A full-size frame takes about 120us on the wire
+  if (eth_txq_count||eth_park_ready) task_add(eth_tx_task, 0, 0, TASK_ETH_TX);
+  return 0;
+}
+
+/**
+ * Drop the parked frames that waited for too long.
+ */
+static void eth_park_expire(void)
+{
+  static byte_t i;
+
+  for(i=0;i<ETH_PARK_SLOTS;i++) {
+    if((eth_park_state[i]==ETH_PARK_WAIT)
+       &&((ticks.d-eth_park_time[i])>=ETH_PARK_TIMEOUT)) {
+      eth_park_state[i]=ETH_PARK_FREE;
+      eth_stats.tx_park_expired++;
+    }
+  }
+}
+
+/**
+ * Have the next hop's address resolved, and build the next frame in a
+ * parking slot to wait for it.
+ * @param hop Next hop.
+ * @return FALSE if the hop is known not to answer, or all slots are taken.
+ */
+static bool_t eth_park_begin(IPV4 *hop)
+{
+  static byte_t i, slot;
+  static bool_t ok;
+  static byte_t hdr[40];
+
+  // arp_resolve() may build a query in _header: keep the IP headers
+  memcpy(hdr,&_header,sizeof(hdr));
+  ok=arp_resolve(hop);
+  memcpy(&_header,hdr,sizeof(hdr));
+  if(!ok) return FALSE;
+
+  eth_park_expire();
+  slot=0xff;
+  for(i=0;i<ETH_PARK_SLOTS;i++)
+    if((eth_park_state[i]==ETH_PARK_FREE)&&(slot==0xff)) slot=i;
+  if(slot==0xff) return FALSE;
+
+  eth_park_hop[slot].d=hop->d;
+  eth_park_time[slot]=ticks.d;
+  eth_park_slot=slot;
+  eth_tx_dest=ETH_PARK_BASE+ETH_TXQ_SLOT*slot;
+  eth_tx_len=0;
+  return TRUE;
+}
+
+/**
+ * A next hop has been resolved: send the frames waiting for it.
+ * @param ip IP address.
+ * @param mac Its MAC address.
+ */
+void eth_arp_resolved(IPV4 *ip, EUI48 *mac)
+{
+  static byte_t i;
+
+  // A late answer must not release frames that have been given up on
+  eth_park_expire();
+  for(i=0;i<ETH_PARK_SLOTS;i++) {
+    if((eth_park_state[i]!=ETH_PARK_WAIT)||(eth_park_hop[i].d!=ip->d)) continue;
+    lcopy((uint32_t)mac,ETH_PARK_BASE+ETH_TXQ_SLOT*i,sizeof(EUI48));
+    eth_park_state[i]=ETH_PARK_READY;
+    eth_park_ready++;
+  }
+  if (eth_park_ready) task_ensure(eth_tx_task, 0, 0, TASK_ETH_TX);
+}
+
 /**
  * Command the ethernet controller to discard the current frame in the
  * RX buffer.
@@ -92,37 +355,177 @@ char dbg_msg[80];
 unsigned char sixteenbytes[16];
 
 /**
- * Ethernet control task.
- * Shall be called when a packet arrives.
+ * Decide from the parse area whether a frame is worth processing.
+ * Frames for other hosts, ethertypes, IP protocols or ports are rejected
+ * before any further copying or checksumming.
+ * @return TRUE if the frame should be passed on.
  */
-uint8_t eth_task (uint8_t p)
+static bool_t eth_rx_filter(void)
 {
+  static byte_t i;
+  static SOCKET *s;
+
   /*
-   * Check if there are incoming packets.
-   * If not, then check in a while.
+   * Destination address: a group address on the allow-list, or ours.
+   * The controller has already checked our own address unless it is
+   * promiscuous.
    */
-  unsigned short i;
+  if(eth_header.destination.b[0] & 0x01) {
+    for(i=0;i<eth_mcast_count;i++)
+      if(!memcmp(&eth_header.destination, &eth_mcast[i], sizeof(EUI48))) break;
+    if(i == eth_mcast_count) {
+      eth_stats.rx_mac++;
+      return FALSE;
+    }
+  } else if(eth_promisc) {
+    if(memcmp(&eth_header.destination, &mac_local, sizeof(EUI48))) {
+      eth_stats.rx_mac++;
+      return FALSE;
+    }
+  }
+
+  for(i=0;i<sizeof(eth_rx_types)/sizeof(eth_rx_types[0]);i++)
+    if(eth_header.type == eth_rx_types[i]) break;
+  if(i == sizeof(eth_rx_types)/sizeof(eth_rx_types[0])) {
+    eth_stats.rx_type++;
+    return FALSE;
+  }
+  if(eth_header.type != 0x0008) return TRUE;
+
+  for(i=0;i<sizeof(eth_rx_protos);i++)
+    if(rx_burst.f.net.ip.protocol == eth_rx_protos[i]) break;
+  if(i == sizeof(eth_rx_protos)) {
+    eth_stats.rx_proto++;
+    return FALSE;
+  }
+  if(rx_burst.f.net.ip.protocol == IP_PROTO_ICMP) return TRUE;
+
+  /*
+   * UDP and TCP: some socket must use the destination port.
+   * Both headers start with the source and destination ports.
+   */
+  for_each(_sockets, s) {
+    if(s->type == SOCKET_FREE) continue;
+    if(s->port == rx_burst.f.net.t.udp.destination) return TRUE;
+  }
+  eth_stats.rx_port++;
+  return FALSE;
+}
+
+/*
+ * Receive batching: eth_task() handles up to ETH_RX_BUDGET frames per
+ * call. While frames keep arriving it runs again straight away; when the
+ * ring is found empty, the polling interval doubles from ETH_POLL_MIN up
+ * to ETH_POLL_MAX milliseconds.
+ */
+#define ETH_RX_BUDGET   4
+#define ETH_POLL_MIN    1
+#ifdef ETH_RX_IRQ
+#define ETH_POLL_MAX    256          // fallback only, the interrupt wakes us
+#else
+#define ETH_POLL_MAX    16
+#endif
+
+static uint16_t eth_poll_interval=ETH_POLL_MIN;
+
+#ifdef ETH_RX_IRQ
+/**
+ * Ethernet interrupt handler.
+ * Masks the RX interrupt until eth_task() has drained the ring, and asks
+ * the scheduler to run eth_task().
+ */
+static unsigned char eth_irq(void)
+{
+  if (!((PEEK(0xD6E1)&0xA0)==0xA0)) return IRQ_NOT_HANDLED;
+  POKE(0xD6E1,0x01);
+  i_task_add(eth_task, 0, 0, TASK_ETH);
+  return IRQ_HANDLED;
+}
+#endif
+
+/**
+ * Number of received frames waiting in the controller's RX ring.
+ */
+static byte_t eth_rx_waiting(void)
+{
   unsigned char j=PEEK(0xD6EF);
-  struct m65_tm tm;
- 
   unsigned char cpu_side=j&3;
   unsigned char eth_side=(j>>2)&3;
 
 #if 0
-   // Check the RXIRQ flag to see if we have frames waiting or not
-   if(!(PEEK(0xD6E1)&0x20)) {
-     task_add(eth_task, 10, 0,"ethtask");
-     return 0;
-   }
+  // Check the RXIRQ flag to see if we have frames waiting or not
+  return (PEEK(0xD6E1)&0x20)?1:0;
 #else
   // XXX Kludge until the Ethernet controller gets updated to have a working
   // RX ready flag.
-  if (((cpu_side-eth_side)&3)==3) {
-    task_add(eth_task, 10, 0,"ethtask");
-    return 0;
-  }
+  return (eth_side-cpu_side-1)&3;
 #endif
-  
+}
+
+/*
+ * Duplicate suppression: the controller sometimes hands over the same
+ * frame more than once. Each TCP segment carrying data is summarised by
+ * its length and a hash of the parse area; one matching one of the last
+ * ETH_DUP_HISTORY segments seen within ETH_DUP_WINDOW milliseconds is
+ * dropped. Genuine retransmissions come much later than that. Other
+ * frames are never dropped: identical ones can be legitimate, such as
+ * duplicate ACKs (which signal a loss to the peer) or repeated ARP
+ * answers.
+ */
+#define ETH_DUP_HISTORY 4
+#define ETH_DUP_WINDOW  20
+
+static struct {
+  uint16_t len;
+  uint16_t hash;
+  uint16_t time;                 ///< Low bits of ticks when seen.
+} eth_dup[ETH_DUP_HISTORY];
+static byte_t eth_dup_next=0;
+
+/**
+ * Check the parse area of a TCP data segment against the recently
+ * received ones, and remember it.
+ * @return TRUE if the frame is a repeat.
+ */
+static bool_t eth_rx_duplicate(void)
+{
+  static byte_t i;
+  static uint16_t h, len, now;
+
+  if(eth_header.type != 0x0008) return FALSE;   // big-endian for 0x0800
+  if(rx_burst.f.net.ip.protocol != IP_PROTO_TCP) return FALSE;
+  len=NTOHS(rx_burst.f.net.ip.length);
+  if(len <= ((rx_burst.f.net.ip.ver_length & 0x0f) << 2)
+            + ((rx_burst.f.net.t.tcp.hlen >> 4) << 2)) return FALSE;
+
+  h=0;
+  for(i=2;i<ETH_RX_BURST;i++) h=((h<<1)|(h>>15))^rx_burst.b[i];
+  len=rx_burst.f.flags;
+  now=(uint16_t)ticks.d;
+
+  for(i=0;i<ETH_DUP_HISTORY;i++)
+    if(eth_dup[i].len==len && eth_dup[i].hash==h
+       && (uint16_t)(now-eth_dup[i].time)<ETH_DUP_WINDOW) {
+      eth_stats.rx_dup++;
+      return TRUE;
+    }
+
+  eth_dup[eth_dup_next].len=len;
+  eth_dup[eth_dup_next].hash=h;
+  eth_dup[eth_dup_next].time=now;
+  eth_dup_next=(eth_dup_next+1)&(ETH_DUP_HISTORY-1);
+  return FALSE;
+}
+
+/**
+ * Take the next frame from the RX ring and pass it up the stack.
+ */
+static void eth_rx_frame(void)
+{
+  unsigned short i;
+  unsigned char j;
+  struct m65_tm tm;
+
   // Get next received packet
   // Just $01 and $03 should be enough, but then packets may be received in triplicate
   // based on testing in wirekrill. But clearing bit 1 again solves this problem.
@@ -145,99 +548,124 @@ uint8_t eth_task (uint8_t p)
     }
   }
   
-  // +2 to skip length and flags field
-  lcopy(ETH_RX_BUFFER+2L,(uint32_t)&eth_header, sizeof(eth_header));
-  
   /*
-   * Check destination address.
+   * Read the length and flags field, the ethernet header and the
+   * network headers in one go, and filter on them.
    */
+  lcopy(ETH_RX_BUFFER,(uint32_t)&rx_burst,ETH_RX_BURST);
+  eth_stats.rx++;
+  if(!eth_rx_filter()) goto drop;
+  if(eth_rx_duplicate()) goto drop;
 
-  if((eth_header.destination.b[0] &
-      eth_header.destination.b[1] &
-      eth_header.destination.b[2] &
-      eth_header.destination.b[3] &
-      eth_header.destination.b[4] &
-      eth_header.destination.b[5]) != 0xff) {
-    /*
-     * Not broadcast, check if it matches the local address.
-     */
-    if(memcmp(&eth_header.destination, &mac_local, sizeof(EUI48)))
-      goto drop;
-  }
-  
   /*
-   * Address match, check protocol.
-   * Read protocol header.
+   * Hand the headers over to the protocol layers.
    */
+  memcpy(&_header,&rx_burst.f.net,sizeof(HEADER));
   if(eth_header.type == 0x0608) {            // big-endian for 0x0806
     /*
      * ARP packet.
      */
-    lcopy(ETH_RX_BUFFER+2+14,(uint32_t)&_header, sizeof(ARP_HDR));
     arp_mens();   
-    goto drop;
-  }
-  else if(eth_header.type == 0x0008) {            // big-endian for 0x0800
+  } else {
     /*
      * IP packet.
-     * Verify transport protocol to load header.
      */
-    lcopy(ETH_RX_BUFFER+2+14,(uint32_t)&_header, sizeof(IP_HDR));
-    update_cache(&_header.ip.source, &eth_header.source);
-    switch(_header.ip.protocol) {
-    case IP_PROTO_UDP:
-      lcopy(ETH_RX_BUFFER+2+14+sizeof(IP_HDR),(uint32_t)&_header.t.udp, sizeof(UDP_HDR));
-      break;
-    case IP_PROTO_TCP:
-      lcopy(ETH_RX_BUFFER+2+14+sizeof(IP_HDR),(uint32_t)&_header.t.tcp, sizeof(TCP_HDR));
-      break;
-    case IP_PROTO_ICMP:
-      lcopy(ETH_RX_BUFFER+2+14+sizeof(IP_HDR),(uint32_t)&_header.t.icmp, sizeof(ICMP_HDR));
-      break;
-    default:
-      goto drop;
-    }
-
     nwk_downstream();
   }
-  else {
-    //    printf("Unknown ether type $%04x\n",eth_header.type);
-  }
   
  drop:
   eth_drop();
-  // We processed a packet, so schedule ourselves immediately, in case there
-  // are more packets coming.
-  task_add(eth_task, 0, 0,"ethtask");                    // try again to check more packets.
+}
+
+/**
+ * Ethernet control task.
+ * Drains the RX ring, and schedules itself again according to traffic.
+ */
+uint8_t eth_task (uint8_t p)
+{
+  static byte_t n, waiting;
+
+  waiting=eth_rx_waiting();
+  if (waiting==3) eth_stats.rx_ring_full++;
+
+  for(n=0;waiting&&(n<ETH_RX_BUDGET);n++) {
+    eth_rx_frame();
+    waiting=eth_rx_waiting();
+  }
+
+  if (waiting) {
+    // Budget used up with frames still waiting: carry on as soon as the
+    // scheduler lets us.
+    eth_poll_interval=ETH_POLL_MIN;
+    task_add(eth_task, 0, 0, TASK_ETH);
+  } else {
+    if (n) eth_poll_interval=ETH_POLL_MIN;
+    else if (eth_poll_interval<ETH_POLL_MAX) eth_poll_interval<<=1;
+    task_add(eth_task, eth_poll_interval, 0, TASK_ETH);
+#ifdef ETH_RX_IRQ
+    // Ring drained: let the next frame interrupt us again
+    POKE(0xD6E1,0x81);
+#endif
+  }
   return 0;
 }
 
 #define IPH(X) _header.ip.X
 
+/**
+ * Append data to the frame being built.
+ */
 void eth_write(uint8_t *buf,uint16_t len)
 {
   if (len+eth_tx_len>=MTU) return;
+  lcopy((uint32_t)buf,eth_tx_dest+eth_tx_len,len);
+#ifdef ETH_TX_MIRROR
   lcopy((uint32_t)buf,(unsigned long)&tx_frame_buf[eth_tx_len],len);
+#endif
   eth_tx_len+=len;
 }
 
 /**
- * Finish transfering an IP packet to the ethernet controller and start transmission.
+ * Start a reply that reuses the frame just received.
+ * The frame is copied from the RX to the TX buffer (or the transmit
+ * queue) by a single DMA job, addressed back to its sender, and its
+ * network headers are replaced by the hlen bytes at hdr.
+ * @param len Frame length, without the RX length and flags field.
+ * @param hdr New headers, written just after the ethernet header.
+ * @param hlen Size of the new headers.
+ * @return TRUE if the frame is ready for eth_packet_send().
+ */
+bool_t eth_reply(uint16_t len,uint8_t *hdr,uint16_t hlen)
+{
+  if ((len>=MTU)||(hlen>sizeof(tx_hdr)-14)) return FALSE;
+  if (!eth_tx_begin()) return FALSE;
+
+  lcopy(ETH_RX_BUFFER+2L,eth_tx_dest,len);
+#ifdef ETH_TX_MIRROR
+  lcopy(ETH_RX_BUFFER+2L,(unsigned long)tx_frame_buf,len);
+#endif
+
+  eth_header_set(&eth_header.source,eth_header.type>>8);
+  memcpy(&tx_hdr[14],hdr,hlen);
+  eth_tx_len=0;
+  eth_write(tx_hdr,14+hlen);
+  eth_tx_len=len;
+  return TRUE;
+}
+
+/**
+ * Finish transfering an IP packet to the ethernet controller and start
+ * transmission, or queue it if it was built in the transmit queue.
  */
 void eth_packet_send(void)
 {
+#ifdef ETH_TX_MIRROR
   unsigned short i;
   unsigned char j;
   struct m65_tm tm;
+#endif
 
-  // Set packet length
-  mega65_io_enable();
-  POKE(0xD6E2,eth_tx_len&0xff);
-  POKE(0xD6E3,eth_tx_len>>8);
-
-  // Copy our working frame buffer to 
-  lcopy((unsigned long)tx_frame_buf,ETH_TX_BUFFER,eth_tx_len);
-
+#ifdef ETH_TX_MIRROR
   if (eth_log_mode&ETH_LOG_TX) {
     getrtc(&tm);
     debug_msg("");
@@ -249,20 +677,33 @@ void eth_packet_send(void)
       debug_msg(dbg_msg);
     }
   }
-  
-
+#endif
   
 #if 0
   printf("ETH TX: %x:%x:%x:%x:%x:%x\n",
 	 tx_frame_buf[0],tx_frame_buf[1],tx_frame_buf[2],tx_frame_buf[3],tx_frame_buf[4],tx_frame_buf[5]
 	 );
 #endif
+
+  if (eth_park_slot!=0xff) {
+    // Built in a parking slot: wait for the next hop's address
+    eth_park_len[eth_park_slot]=eth_tx_len;
+    eth_park_state[eth_park_slot]=ETH_PARK_WAIT;
+    eth_park_slot=0xff;
+    eth_stats.tx_parked++;
+    return;
+  }
   
-  // Make sure ethernet is not under reset
-  POKE(0xD6E0,0x03);
-  
-  // Send packet
-  POKE(0xD6E4,0x01); // TX now
+  if (eth_tx_dest!=ETH_TX_BUFFER) {
+    eth_txq_len[(eth_txq_head+eth_txq_count)&(ETH_TXQ_SLOTS-1)]=eth_tx_len;
+    eth_txq_count++;
+    eth_stats.tx_queued++;
+    task_ensure(eth_tx_task, 0, 0, TASK_ETH_TX);
+    return;
+  }
+
+  // The frame is already in the TX buffer
+  eth_tx_start(eth_tx_len);
 }
 
 
@@ -277,8 +718,8 @@ eth_ip_send()
    static IPV4 ip;
    static EUI48 mac;
 
-   if(!eth_clear_to_send()) {
-     return FALSE;               // another transmission in progress, fail.
+   if(!eth_tx_space()) {
+     return FALSE;               // transmit queue full, fail.
    }
 
    /*
@@ -292,28 +733,26 @@ eth_ip_send()
 	}
    }
 
-   if(!query_cache(&ip, &mac)) {                   // find MAC
-      arp_query(&ip);                              // yet unknown IP, query MAC and fail.
-      //      printf("A");
-      return FALSE;
+   if(query_cache(&ip, &mac)) {                    // find MAC
+      if(!eth_tx_begin()) return FALSE;
+   } else {
+      /*
+       * Yet unknown IP: query MAC and have the frame wait for it, or fail
+       * if the IP does not answer or there is no room to wait.
+       */
+      if(!eth_park_begin(&ip)) return FALSE;
+      memset(&mac, 0, sizeof(EUI48));              // filled in by eth_arp_resolved()
    }
 
    /*
-    * Send ethernet header.
-    */
-   eth_tx_len=0;
-
-   eth_write((uint8_t*)&mac, 6);
-   eth_write((uint8_t*)&mac_local, 6);
-   eth(0x08);                                      // type = IP (0x0800)
-   eth(0x00);
-
-   /*
-    * Send protocol header.
+    * Send ethernet and protocol headers.
     */
    if(IPH(protocol) == IP_PROTO_UDP) eth_size = 28;    // header size
    else eth_size = 40;
-   eth_write((uint8_t*)&_header, eth_size);
+
+   eth_header_set(&mac, 0x00);                     // type = IP (0x0800)
+   memcpy(&tx_hdr[14], &_header, eth_size);
+   eth_write(tx_hdr, 14+eth_size);
    
    //   printf("eth_ip_send success.\n");
    return TRUE;
@@ -327,19 +766,14 @@ void
 eth_arp_send
    (EUI48 *mac)
 {
-  if(!(PEEK(0xD6E0)&0x80)) return;                     // another transmission in progress.
+   if(!eth_tx_begin()) return;                     // transmit queue full.
    
-   eth_tx_len=0;
-
-   eth_write((uint8_t*)mac, 6);
-   eth_write((uint8_t*)&mac_local, 6);
-   eth(0x08);                                      // type = ARP (0x0806)
-   eth(0x06);
-
    /*
-    * Send protocol header.
+    * Send ethernet and protocol headers.
     */
-   eth_write((uint8_t*)&_header, sizeof(ARP_HDR));
+   eth_header_set(mac, 0x06);                      // type = ARP (0x0806)
+   memcpy(&tx_hdr[14], &_header, sizeof(ARP_HDR));
+   eth_write(tx_hdr, 14+sizeof(ARP_HDR));
    
    /*
     * Start transmission.
@@ -347,6 +781,113 @@ eth_arp_send
    eth_packet_send();
 }
 
+static const byte_t eth_broadcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+/**
+ * Program the controller's address filter from the allow-list and the
+ * promiscuous flag.
+ */
+static void eth_filter_update(void)
+{
+  static byte_t i, r;
+
+  r = PEEK(0xD6E5) & ~(ETH_NOPROM|ETH_BCST|ETH_MCST);
+  if(!eth_promisc) r |= ETH_NOPROM;
+  for(i=0;i<eth_mcast_count;i++) {
+    if(memcmp(&eth_mcast[i], eth_broadcast, sizeof(EUI48))) r |= ETH_MCST;
+    else r |= ETH_BCST;
+  }
+  POKE(0xD6E5,r);
+}
+
+/**
+ * Accept frames sent to a broadcast or multicast address.
+ * @param mac Group address.
+ * @return FALSE if the allow-list is full, or mac is not a group address.
+ */
+bool_t eth_mcast_add(EUI48 *mac)
+{
+  static byte_t i;
+
+  if(!(mac->b[0] & 0x01)) return FALSE;
+  for(i=0;i<eth_mcast_count;i++)
+    if(!memcmp(mac, &eth_mcast[i], sizeof(EUI48))) return TRUE;
+  if(eth_mcast_count == ETH_MCAST_MAX) return FALSE;
+  memcpy(&eth_mcast[eth_mcast_count++], mac, sizeof(EUI48));
+  eth_filter_update();
+  return TRUE;
+}
+
+/**
+ * Stop accepting frames sent to a broadcast or multicast address.
+ * Removing the broadcast address stops ARP and DHCP from working.
+ * @param mac Group address.
+ * @return FALSE if it was not on the allow-list.
+ */
+bool_t eth_mcast_remove(EUI48 *mac)
+{
+  static byte_t i;
+
+  for(i=0;i<eth_mcast_count;i++)
+    if(!memcmp(mac, &eth_mcast[i], sizeof(EUI48))) break;
+  if(i == eth_mcast_count) return FALSE;
+  eth_mcast_count--;
+  for(;i<eth_mcast_count;i++) memcpy(&eth_mcast[i], &eth_mcast[i+1], sizeof(EUI48));
+  eth_filter_update();
+  return TRUE;
+}
+
+/**
+ * Switch promiscuous mode, in which the controller passes every frame on
+ * the segment. Meant for capturing traffic with ETH_LOG_RX; the stack
+ * still only handles frames addressed to us.
+ * @param on TRUE to enable.
+ */
+void eth_promiscuous(bool_t on)
+{
+  eth_promisc=on;
+  eth_filter_update();
+}
+
+/*
+ * Link monitoring: eth_link_task() reads the PHY's basic status register
+ * (BMSR) through the MIIM interface every ETH_LINK_POLL milliseconds.
+ * The register is selected in $D6E6 (keeping the PHY number in bits 5-7)
+ * and its value read from $D6E7/8 on the following run, so that the task
+ * never waits for the MDIO transfer.
+ */
+#define ETH_LINK_POLL   500
+#define MII_BMSR        1
+#define BMSR_LINK       0x04
+
+/**
+ * Link state as last seen (assumed up until the PHY says otherwise).
+ */
+bool_t eth_link_up=TRUE;
+
+/**
+ * Link monitoring task.
+ * Tells the network layer when the link goes down or comes back.
+ */
+byte_t eth_link_task(byte_t sig)
+{
+  static bool_t up;
+  static byte_t lo, hi;
+
+  lo=PEEK(0xD6E7);
+  hi=PEEK(0xD6E8);
+  up=(lo&BMSR_LINK)?TRUE:FALSE;
+  // All zeroes or all ones: no PHY answering, leave the state alone.
+  if((lo|hi) && (lo&hi)!=0xff && up!=eth_link_up) {
+    eth_link_up=up;
+    nwk_link_changed();
+  }
+
+  POKE(0xD6E6,(PEEK(0xD6E6)&0xe0)|MII_BMSR);
+  task_add(eth_link_task, ETH_LINK_POLL, 0, TASK_ETH_LINK);
+  return 0;
+}
+
 /**
  * Ethernet controller initialization and configuration.
  */
@@ -356,13 +897,10 @@ eth_init()
    eth_drop();
 
    /*
-    * Setup frame reception filter.
+    * Setup frame reception filter: our address, and broadcasts.
     */
-#if defined(_PROMISCUOUS)
-   POKE(0xD6E5,PEEK(0xD6E5)&0xFE);
-#else
-   POKE(0xD6E5,PEEK(0xD6E5)|0x01);
-#endif
+   eth_mcast_count=0;
+   eth_mcast_add((EUI48*)eth_broadcast);
 #ifdef NOCRCCHECK
    POKE(0xD6E5,PEEK(0xD6E5)|0x02);
 #endif
@@ -376,13 +914,31 @@ eth_init()
     */
    lcopy(0xFFD36E9,(unsigned long)&mac_local.b[0],6);
 
+   eth_txq_head=0;
+   eth_txq_count=0;
+   memset(eth_park_state,ETH_PARK_FREE,sizeof(eth_park_state));
+   eth_park_ready=0;
+
+   // Select the PHY status register for link monitoring; weeip_init()
+   // starts eth_link_task(), so that eth_init() can be called before the
+   // scheduler is set up.
+   eth_link_up=TRUE;
+   POKE(0xD6E6,(PEEK(0xD6E6)&0xe0)|MII_BMSR);
+
    // Reset, then release from reset and reset TX FSM
    POKE(0xd6e0,0);
    POKE(0xd6e0,3);
    POKE(0xd6e1,3);
    POKE(0xd6e1,0);
    
-   // XXX Enable ethernet IRQs?
+#ifdef ETH_RX_IRQ
+   // Enable the RX interrupt
+   if (!eth_irq_installed) {
+     set_irq(eth_irq, eth_irq_stack, ETH_IRQ_STACK);
+     eth_irq_installed=TRUE;
+   }
+   POKE(0xD6E1,0x81);
+#endif
 }
 
 /**
@@ -393,6 +949,11 @@ void eth_disable()
    /*
     * Wait for any pending activity.
     */
-   // XXX Disable ethernet IRQs?
+#ifdef ETH_RX_IRQ
+   POKE(0xD6E1,0x01);
+   if (eth_irq_installed) reset_irq();
+   eth_irq_installed=FALSE;
+#endif
+   task_cancel(TASK_ETH_LINK);
 }
 
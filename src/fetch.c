@@ -8,6 +8,7 @@
 #include "arp.h"
 #include "dns.h"
 #include "dhcp.h"
+#include "warmstart.h"
 
 #include "memory.h"
 #include "random.h"
@@ -216,15 +217,19 @@ void prepare_network(void)
   
   // Setup WeeIP
   weeip_init();
-  task_cancel(eth_task);
-  task_add(eth_task, 0, 0,"eth");
-
-  // Do DHCP auto-configuration
-  dhcp_configured=0;
-  printf("Configuring network via DHCP\n");
+  task_add(eth_task, 0, 0, TASK_ETH);
+  // Keep network work to raster lines $10-$df, leaving the bottom
+  // border for scrolling and the mouse.
+  task_frame_window(0x10, 0xd0);
+
+  // Do DHCP auto-configuration (unless weeip_init() could reuse the
+  // configuration of an earlier run: that is checked first, and DHCP
+  // still runs if its address has been taken meanwhile)
+  if(warmstart_pending) printf("Checking the previous network configuration\n");
+  else printf("Configuring network via DHCP\n");
   dhcp_autoconfig();
   while(!dhcp_configured) {
-    task_periodic();
+    task_periodic_frame();
     // Let the mouse move around
     update_mouse_position(0);
   }
@@ -336,9 +341,7 @@ restart_fetch:
   socket_connect(&a,port);
 
   while(!disconnected) {
-    // XXX Actually only call it periodically
-
-    task_periodic();
+    task_periodic_frame();
 
     update_mouse_position(0);
     if (h65_error) break;
@@ -728,6 +731,7 @@ void main(void)
   lcopy((unsigned long)type_url,0xD000L,19);
   
   // Give ethernet interface time to auto negotiate etc
+  // (weeip_init() sets up the scheduler, and the controller again, later)
   eth_init();
 
   // Get initial mouse position
@@ -8,6 +8,7 @@
 #include "arp.h"
 #include "dns.h"
 #include "dhcp.h"
+#include "warmstart.h"
 
 #include "memory.h"
 #include "random.h"
@@ -58,18 +59,11 @@ const struct bbs bbs_list[27]=
   };
 
 
-void interrupt_handler(void)
-{
-      tick();
-      i_task_cancel(eth_task);
-      i_task_add(eth_task, 0, 0);
-}
-
 /* No idea what this does. */
 byte_t pisca (byte_t p)
 {
   // Just adds itself to be run periodically?
-   task_add(pisca, 32, !p);
+   task_add(pisca, 510, !p, TASK_APP1);
    return 0; // XXX and what should it return?
 }
 
@@ -152,7 +146,9 @@ void main(void)
   
   // Setup WeeIP
   weeip_init();
-  interrupt_handler();   
+  // Start polling for received frames (i_task_add() is for interrupt
+  // context only)
+  task_ensure(eth_task, 0, 0, TASK_ETH);
   
   // Clear buffer of received data we maintain for debugging
   lfill(0x12000,0,4);
@@ -161,8 +157,10 @@ void main(void)
   lfill(0x50000,0,32768);
   lfill(0x58000,0,32768);
   
-  // Do DHCP auto-configuration
-  printf("Configuring network via DHCP\n");
+  // Do DHCP auto-configuration (unless the configuration of an earlier
+  // run is being checked for reuse)
+  if(warmstart_pending) printf("Checking the previous network configuration\n");
+  else printf("Configuring network via DHCP\n");
   dhcp_autoconfig();
   while(!dhcp_configured) {
     task_periodic();
@@ -228,6 +226,10 @@ void main(void)
 	 printf("%c%c%c%c%c%cDisconnecting...",0x0d,0x05,0x12,0x11,0x11,0x11,0x11);
 	 socket_reset();
        }
+#ifdef TASK_PROFILE
+       // F1 shows where the network time goes
+       if (PEEK(0xD610)==0xF1) task_profile_dump();
+#endif
        POKE(0xD610,0);
      }
 
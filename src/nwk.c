@@ -79,11 +79,6 @@ static _uint32_t seq;
 #define UDPH(X) _header.t.udp.X
 #define IPH(X) _header.ip.X
 
-// Smaller MTU to save memory
-#define MTU 1000
-extern unsigned char tx_frame_buf[MTU];
-extern unsigned short eth_tx_len;
-
 /**
  * Packet counter.
  */
@@ -113,8 +108,106 @@ byte_t default_header[] = {
  */
 byte_t _flags;
 
+/**
+ * Link state change, reported by eth_link_task().
+ * While the link is down nwk_tick() holds the TCP timers. When it comes
+ * back, announce ourselves and retransmit whatever is outstanding right
+ * away, instead of waiting for the timers.
+ */
+void nwk_link_changed(void)
+{
+   if(!eth_link_up) return;
+
+   arp_announce();
+
+   for_each(_sockets, _sckt) {
+      if(_sckt->type != SOCKET_TCP) continue;
+      switch(_sckt->state) {
+         case _SYN_SENT:
+         case _SYN_REC:
+         case _ACK_REC:
+         case _ACK_WAIT:
+         case _FIN_SENT:
+         case _FIN_REC:
+         case _FIN_ACK_REC:
+            _sckt->time = 1;
+            break;
+         default:
+            break;
+      }
+   }
+   task_add(nwk_tick, 0, 0, TASK_NWK_TICK);
+}
+
 void remove_rx_data(SOCKET *_sckt);
 
+/**
+ * Order in which pending socket events are delivered.
+ */
+static const byte_t nwk_event_order[] = {
+   WEEIP_EV_CONNECT,
+   WEEIP_EV_DATA,
+   WEEIP_EV_DISCONNECT_WITH_DATA,
+   WEEIP_EV_DATA_SENT,
+   WEEIP_EV_DISCONNECT
+};
+
+/**
+ * Queue an event for the callback of a socket.
+ * Events are delivered later by nwk_events(), so that slow callbacks do not
+ * hold up reception. A repeated event is only delivered once, so several
+ * segments arriving before the callback runs are seen as a single DATA
+ * event covering all of them.
+ * @param s Socket.
+ * @param ev Event.
+ */
+static void nwk_post_event(SOCKET *s, WEEIP_EVENT ev)
+{
+   s->events |= 1 << ev;
+   task_ensure(nwk_events, 0, 0, TASK_NWK_EVENTS);
+}
+
+/**
+ * Socket event task.
+ * Calls the socket callbacks for the events queued by the network layers.
+ * Received data is released once a DATA event was delivered, and the
+ * peer is told about the window that opened.
+ */
+byte_t nwk_events (byte_t sig)
+{
+   static SOCKET *s;
+   static byte_t i, ev;
+   static uint16_t consumed;
+
+   /*
+    * Callbacks may select other sockets, so walk with our own pointer.
+    */
+   for_each(_sockets, s) {
+      for(i=0;i<sizeof(nwk_event_order);i++) {
+         if(s->type == SOCKET_FREE) break;
+         ev = nwk_event_order[i];
+         if(!(s->events & (1 << ev))) continue;
+         s->events &= ~(1 << ev);
+         _sckt = s;
+         if(s->callback) s->callback(ev);
+
+         if((ev == WEEIP_EV_DATA) || (ev == WEEIP_EV_DISCONNECT_WITH_DATA)) {
+            consumed = s->rx_data;
+            remove_rx_data(s);
+            if(consumed && (s->type == SOCKET_TCP)
+               && ((s->state == _CONNECT) || (s->state == _ACK_WAIT))) {
+               /*
+                * Window update.
+                */
+               s->toSend |= ACK;
+               task_ensure(nwk_upstream, 0, 0, TASK_NWK_UPSTREAM);
+            }
+         }
+      }
+   }
+   return 0;
+}
+
 
 /**
  * TCP timing control task.
@@ -124,6 +217,15 @@ byte_t nwk_tick (byte_t sig)
 {
    static byte_t t=0;
 
+   /*
+    * Retransmitting into a dead link is pointless: hold the timers
+    * until it comes back (see nwk_link_changed()).
+    */
+   if(!eth_link_up) {
+      task_add(nwk_tick, TICK_TCP, 0, TASK_NWK_TICK);
+      return 0;
+   }
+
    /*
     * Loop all sockets.
     */
@@ -188,8 +290,7 @@ byte_t nwk_tick (byte_t sig)
 #ifdef DEBUG_ACK
 	      debug_msg("scheduling nwk_upstream 0 0");
 #endif
-	      task_cancel(nwk_upstream);
-	      task_add(nwk_upstream, 0, 0,"upstream");
+	      task_ensure(nwk_upstream, 0, 0, TASK_NWK_UPSTREAM);
             } 
         } else {
             /*
@@ -197,8 +298,7 @@ byte_t nwk_tick (byte_t sig)
              * Socket down.
              */
             _sckt->state = _IDLE;
-	    _sckt->callback(WEEIP_EV_DISCONNECT);
-	    remove_rx_data(_sckt);
+	    nwk_post_event(_sckt, WEEIP_EV_DISCONNECT);
          }
       }
    } 
@@ -206,7 +306,7 @@ byte_t nwk_tick (byte_t sig)
    /*
     * Reschedule task for periodic execution.
     */
-   task_add(nwk_tick, TICK_TCP, 0,"nwktick");
+   task_add(nwk_tick, TICK_TCP, 0, TASK_NWK_TICK);
    return 0;
 }
 
@@ -238,82 +338,59 @@ void compute_window_size(SOCKET *_sckt)
 }
 
 /**
- * Network upstream task. Send outgoing network messages.
+ * Send the pending segment of the selected socket.
+ * @return FALSE if it could not be sent (no ARP entry or no TX space yet).
  */
-byte_t nwk_upstream (byte_t sig)
+static bool_t nwk_send_segment(void)
 {
-      
 #ifdef DEBUG_ACK
-   debug_msg("nwk_upstream called.");
+   debug_msg("nwk_upstream sending a packet for socket");
 #endif
+      
+   /*
+    * Pending message found, send it.
+    */
+   checksum_init();
+
+   compute_window_size(_sckt);
    
-   if(!eth_clear_to_send()) {
-      /*
-       * Ethernet not ready.
-       * Delay task execution.
-       */
-     //     printf("ETH TX wait\n");
-#ifdef DEBUG_ACK
-     debug_msg("scheduling nwk_upstream 2 0");
-#endif
-     task_add(nwk_upstream, 2, 0,"upstream");
-      return 0;
-   }
+   // XXX Correct buffer offset processing to handle variable
+   // header lengths
+   lcopy((uint32_t)default_header,(uint32_t)_header.b,40);
+
+   IPH(id) = HTONS(id);
+   id++;
+
+   IPH(source).d = ip_local.d;
+   IPH(destination).d = _sckt->remIP.d;
+   TCPH(source) = _sckt->port;
+   TCPH(destination) = _sckt->remPort;
    
    /*
-    * Search for pending messages.
+    * Check payload area in _sckt->tx.
     */
-   for_each(_sockets, _sckt) {     
-      if(!_sckt->toSend) continue;                          // no message to send for this socket.
-
-#ifdef DEBUG_ACK
-      debug_msg("nwk_upstream sending a packet for socket");
-#endif
-      
+   if(_sckt->toSend & PSH) {
+      data_size = _sckt->tx_size;
+      ip_checksum((byte_t*)_sckt->tx, data_size);
+   } else data_size = 0;
+   
+   if(_sckt->type == SOCKET_TCP) {
       /*
-       * Pending message found, send it.
+       * TCP message header.
        */
-      checksum_init();
-
-      compute_window_size(_sckt);
-      
-      // XXX Correct buffer offset processing to handle variable
-      // header lengths
-      lcopy((uint32_t)default_header,(uint32_t)_header.b,40);
-
-      IPH(id) = HTONS(id);
-      id++;
+      IPH(length) = HTONS((40 + data_size));
+      TCPH(flags) = _sckt->toSend;
 
-      IPH(source).d = ip_local.d;
-      IPH(destination).d = _sckt->remIP.d;
-      TCPH(source) = _sckt->port;
-      TCPH(destination) = _sckt->remPort;
-      
       /*
-       * Check payload area in _sckt->tx.
+       * Check sequence numbers.
        */
-      if(_sckt->toSend & PSH) {
-         data_size = _sckt->tx_size;
-         ip_checksum((byte_t*)_sckt->tx, data_size);
-      } else data_size = 0;
-      
-      if(_sckt->type == SOCKET_TCP) {
+      seq.d = _sckt->seq.d;
+      if(_sckt->timeout) {
          /*
-          * TCP message header.
+          * Retransmission.
+          * Use old sequence number.
           */
-         IPH(length) = HTONS((40 + data_size));
-         TCPH(flags) = _sckt->toSend;
-
-         /*
-          * Check sequence numbers.
-          */
-         seq.d = _sckt->seq.d;
-         if(_sckt->timeout) {
-            /*
-             * Retransmission.
-             * Use old sequence number.
-             */
-            if(data_size) seq.d -= data_size;
+         if(data_size) seq.d -= data_size;
 
 	    // XXX Why on earth do we subtract one here?
 	    // This messes up connections sometimes, because
@@ -323,96 +400,148 @@ byte_t nwk_upstream (byte_t sig)
 	    // by one, so the other side gets VERY confused, and says
 	    // RST!
 	    //            if(_sckt->toSend & (SYN | FIN)) seq.d--;
-         }
+      }
 
-         TCPH(n_seq).b[0] = seq.b[3];
-         TCPH(n_seq).b[1] = seq.b[2];
-         TCPH(n_seq).b[2] = seq.b[1];
-         TCPH(n_seq).b[3] = seq.b[0];
-         TCPH(n_ack).b[0] = _sckt->remSeq.b[3];
-         TCPH(n_ack).b[1] = _sckt->remSeq.b[2];
-         TCPH(n_ack).b[2] = _sckt->remSeq.b[1];
-         TCPH(n_ack).b[3] = _sckt->remSeq.b[0];
+      TCPH(n_seq).b[0] = seq.b[3];
+      TCPH(n_seq).b[1] = seq.b[2];
+      TCPH(n_seq).b[2] = seq.b[1];
+      TCPH(n_seq).b[3] = seq.b[0];
+      TCPH(n_ack).b[0] = _sckt->remSeq.b[3];
+      TCPH(n_ack).b[1] = _sckt->remSeq.b[2];
+      TCPH(n_ack).b[2] = _sckt->remSeq.b[1];
+      TCPH(n_ack).b[3] = _sckt->remSeq.b[0];
 
 	 if (_sckt->remSeq.d-_sckt->remSeqStart.d)
 	   //	   printf("ACKing %ld\n",_sckt->remSeq.d-_sckt->remSeqStart.d+data_size);
 
-         if(!_sckt->timeout) {
-            /*
-             * Update sequence number data.
-             */
-            if(data_size) seq.d += data_size;
-            if(_sckt->toSend & (SYN | FIN)) seq.d++;
-            _sckt->seq.d = seq.d;
-         }
-
+      if(!_sckt->timeout) {
          /*
-          * Update TCP checksum information.
+          * Update sequence number data.
           */
-         TCPH(checksum) = 0;
-         ip_checksum(&_header.b[12], 8 + sizeof(TCP_HDR));
-         add_checksum(IP_PROTO_TCP);
-         add_checksum(data_size + sizeof(TCP_HDR));
-         TCPH(checksum) = checksum_result();
-      } else {
-         /*
-          * UDP message header.
-          */
-         IPH(protocol) = IP_PROTO_UDP;
-         IPH(length) = HTONS((28 + data_size));
-         UDPH(length) = HTONS((8 + data_size));
+         if(data_size) seq.d += data_size;
+         if(_sckt->toSend & (SYN | FIN)) seq.d++;
+         _sckt->seq.d = seq.d;
+      }
 
-         /*
-          * Update UDP checksum information.
-          */
-         UDPH(checksum) = 0;
-         ip_checksum(&_header.b[12], 8 + sizeof(UDP_HDR));
-         add_checksum(IP_PROTO_UDP);
-         add_checksum(data_size + sizeof(UDP_HDR));
-         UDPH(checksum) = checksum_result();
+      /*
+       * Update TCP checksum information.
+       */
+      TCPH(checksum) = 0;
+      ip_checksum(&_header.b[12], 8 + sizeof(TCP_HDR));
+      add_checksum(IP_PROTO_TCP);
+      add_checksum(data_size + sizeof(TCP_HDR));
+      TCPH(checksum) = checksum_result();
+   } else {
+      /*
+       * UDP message header.
+       */
+      IPH(protocol) = IP_PROTO_UDP;
+      IPH(length) = HTONS((28 + data_size));
+      UDPH(length) = HTONS((8 + data_size));
 
-         /*
-          * Tell UDP that data was sent (no acknowledge).
-          */
-	 _sckt->callback(WEEIP_EV_DATA_SENT);
-	 remove_rx_data(_sckt);
-      }
-      
       /*
-       * Update IP checksum information.
+       * Update UDP checksum information.
        */
-      checksum_init();
-      ip_checksum((byte_t*)&_header, 20);
-      IPH(checksum) = checksum_result();
-      
+      UDPH(checksum) = 0;
+      ip_checksum(&_header.b[12], 8 + sizeof(UDP_HDR));
+      add_checksum(IP_PROTO_UDP);
+      add_checksum(data_size + sizeof(UDP_HDR));
+      UDPH(checksum) = checksum_result();
+
       /*
-       * Send IP packet.
+       * Tell UDP that data was sent (no acknowledge).
        */
-      if(eth_ip_send()) {
-         if(data_size) eth_write((byte_t*)_sckt->tx, data_size);
+      nwk_post_event(_sckt, WEEIP_EV_DATA_SENT);
+   }
+   
+   /*
+    * Update IP checksum information.
+    */
+   checksum_init();
+   ip_checksum((byte_t*)&_header, 20);
+   IPH(checksum) = checksum_result();
+   
+   /*
+    * Send IP packet.
+    */
+   if(!eth_ip_send()) {
+	// Sending the IP packet failed, possibly because there was no ARP
+	// entry for the next hop and no room left to wait for one.
+
+	// So we don't clear the status that we need to send
+	return FALSE;
+   }
+
+   if(data_size) eth_write((byte_t*)_sckt->tx, data_size);
 #ifdef DEBUG_ACK
-	 debug_msg("eth_packet_send() called");
+   debug_msg("eth_packet_send() called");
 #endif
-         eth_packet_send();
+   eth_packet_send();
 
-	 _sckt->toSend = 0;
-	 _sckt->timeout = FALSE;
-	 _sckt->time = SOCKET_TIMEOUT(_sckt);
-	 
-      } else {
-	// Sending the IP packet failed, possibly because there was no ARP
-	// entry for the requested IP, if it is on the local network.
+   _sckt->toSend = 0;
+   _sckt->timeout = FALSE;
+   _sckt->time = SOCKET_TIMEOUT(_sckt);
+   return TRUE;
+}
 
-	// So we don't clear the status that we need to send
+/**
+ * Socket to serve first on the next nwk_upstream() call.
+ */
+static byte_t nwk_rr_next=0;
+
+/**
+ * Network upstream task. Send outgoing network messages.
+ * Control segments (ACK, SYN, FIN without payload) go first, then data
+ * segments. Each round starts after the socket whose data was sent last,
+ * so that a busy socket cannot keep the others waiting when the transmit
+ * queue fills up.
+ */
+byte_t nwk_upstream (byte_t sig)
+{
+   static byte_t round, n, i;
+   static bool_t pending;
+      
+#ifdef DEBUG_ACK
+   debug_msg("nwk_upstream called.");
+#endif
+
+   pending = FALSE;
+   for(round=0;round<2;round++) {
+      for(n=0;n<MAX_SOCKET;n++) {
+         i = nwk_rr_next + n;
+         if(i >= MAX_SOCKET) i -= MAX_SOCKET;
+         _sckt = &_sockets[i];
+         if(!_sckt->toSend) continue;                       // no message to send for this socket.
+         if((round == 0) == ((_sckt->toSend & PSH) != 0)) continue;   // not this round.
+
+         if(!eth_tx_space()) {
+            /*
+             * Ethernet not ready.
+             * Delay task execution.
+             */
+#ifdef DEBUG_ACK
+            debug_msg("scheduling nwk_upstream 20 0");
+#endif
+            task_ensure(nwk_upstream, 20, 0, TASK_NWK_UPSTREAM);
+            return 0;
+         }
+
+         if(!nwk_send_segment()) pending = TRUE;
+         else if(round == 1) {
+            nwk_rr_next = i + 1;
+            if(nwk_rr_next >= MAX_SOCKET) nwk_rr_next = 0;
+         }
       }
+   }
 
+   if(pending) {
       /*
        * Reschedule 50ms later for eventual further processing.
        */
 #ifdef DEBUG_ACK
-     debug_msg("scheduling nwk_upstream 5 0");
+      debug_msg("scheduling nwk_upstream 50 0");
 #endif
-     task_add(nwk_upstream, 5, 0,"upstream");
+      task_ensure(nwk_upstream, 50, 0, TASK_NWK_UPSTREAM);
    }
    
    /*
@@ -448,8 +577,7 @@ void nwk_schedule_oo_ack(SOCKET *_sckt)
   debug_msg("asserting ack: Out-of-order rx");
   debug_msg("scheduling nwk_upstream 0 0");
 #endif
-  task_cancel(nwk_upstream);
-  task_add(nwk_upstream, 0, 0,"upstream");
+  task_ensure(nwk_upstream, 0, 0, TASK_NWK_UPSTREAM);
 }
 
 /**
@@ -461,6 +589,7 @@ void nwk_downstream(void)
    WEEIP_EVENT ev;
    _uint32_t rel_sequence;
    static unsigned char i;
+   static uint16_t old_rx_data;
 
    ev = WEEIP_EV_NONE;
 
@@ -537,6 +666,7 @@ found:
     * Add task for processing.
     */
    data_size -= 28;
+   if(_sckt->rx_data) goto drop;                               // previous datagram not delivered yet.
    if(_sckt->rx) {
       if(data_size > _sckt->rx_size) data_size = _sckt->rx_size;
       lcopy(ETH_RX_BUFFER+2+14+sizeof(IP_HDR)+8,(uint32_t)_sckt->rx, data_size);
@@ -608,8 +738,12 @@ parse_tcp:
      // header lengths
      data_ofs=((IPH(ver_length)&0x0f)<<2)+((TCPH(hlen)>>4)<<2);
      
+     // The buffer may still hold data the callback has not seen yet, which
+     // ends at remSeq, so offsets in the buffer are relative to its start.
+     old_rx_data=_sckt->rx_data;
      for(i=0;i<4;i++) rel_sequence.b[i]=TCPH(n_seq.b[3-i]);
      rel_sequence.d-=_sckt->remSeq.d;
+     rel_sequence.d+=old_rx_data;
 
 #if 0
      printf("\n%5ld: rel_seq=%ld, rx:%d,%d to %d\n",
@@ -632,6 +766,9 @@ parse_tcp:
 	 lcopy(ETH_RX_BUFFER+16+data_ofs,_sckt->rx_data + (uint32_t)_sckt->rx, data_size);
        }
        _sckt->rx_data += data_size;       
+     } else if (rel_sequence.w[0]<_sckt->rx_data) {
+       // Retransmission of data we already hold
+       if (data_size) { nwk_schedule_oo_ack(_sckt); goto drop; }
      } else if (rel_sequence.w[0]==_sckt->rx_oo_end) {
        // Copy to end of OO data in RX buffer
        // printf("oo append");
@@ -674,13 +811,10 @@ parse_tcp:
       /*
        * Update stream sequence number.
        */
-      _sckt->remSeq.d += _sckt->rx_data;
+      _sckt->remSeq.d += _sckt->rx_data - old_rx_data;
 
       // Deliver data to programme
-      if (_sckt->rx_data) {
-	_sckt->callback(WEEIP_EV_DATA);
-	remove_rx_data(_sckt);
-      }
+      if (_sckt->rx_data!=old_rx_data) nwk_post_event(_sckt, WEEIP_EV_DATA);
       
       // And ACK every packet, because we don't have buffer space for multiple ones,
       // and its thus very easy for the sender to not know where we are upto, and for
@@ -884,45 +1018,33 @@ parse_tcp:
 #ifdef ENABLE_ICMP
    if (ICMPH(type)==0x08) {
      if (ICMPH(fcode)==0x00) {
-       // ICMP Echo request: 
-
-       // 0. Copy received packet to tx buffer
-       lcopy(ETH_RX_BUFFER+2L,(long)tx_frame_buf,14+data_size);
-
-       // 1. Copy Eth src to DST
-       lcopy((long)&tx_frame_buf[0+6],(long)&tx_frame_buf[0],6);
-
-       // 2. Put our ETH as src
-       lcopy((long)0xD6E9,(long)&tx_frame_buf[0+6],6);
-       
-       // 3. IP SRC becomes DST
-       lcopy((long)&tx_frame_buf[14+12],(long)&tx_frame_buf[14+16],4);
-       
-       // 4. Put our IP as SRC
-       lcopy((long)&ip_local.b[0],(long)&tx_frame_buf[14+12],4);
-       
-       // 5. Change type from 0x08 (ECHO REQUEST) to 0x00 (ECHO REPLY)
-       tx_frame_buf[14+20]=0x00;
-       
-       // 6. Update ICMP checksum
-       tx_frame_buf[14+20+2]=0; tx_frame_buf[14+20+2+1]=0;
-       chks.b[0]=0; chks.b[1]=0;
-       ip_checksum(&tx_frame_buf[14+20],data_size);
-       // XXX For some reason if we do the following assignment as single
-       // operation, it crashes the programme. But doing it this way,
-       // seems to be fine. Go figure :/
-       tx_frame_buf[14+20+2] = (checksum_result());
-       tx_frame_buf[14+20+3] = (checksum_result())>>8;
-       
-       // 7. Update IP checksum
-       tx_frame_buf[14+10]=0; tx_frame_buf[14+11]=0;
-       chks.b[0]=0; chks.b[1]=0;
-       ip_checksum(&tx_frame_buf[14],20);
-       *(unsigned short *)&tx_frame_buf[14+10] = checksum_result();
+       // ICMP Echo request: the reply is the same frame, sent back with
+       // new headers, so the payload goes from RX to TX buffer in one DMA.
+       static byte_t *c;
+       static uint16_t sum;
+
+       // 1. IP SRC becomes DST, and our IP becomes SRC
+       IPH(destination).d = IPH(source).d;
+       IPH(source).d = ip_local.d;
+
+       // 2. Update IP checksum
+       IPH(checksum) = 0;
+       checksum_init();
+       ip_checksum((byte_t*)&_header, 20);
+       IPH(checksum) = checksum_result();
+
+       // 3. Change type from 0x08 (ECHO REQUEST) to 0x00 (ECHO REPLY).
+       // That takes $0800 off the sum, so add it to the checksum
+       // (RFC 1624) instead of summing the whole payload again.
+       ICMPH(type)=0x00;
+       c=(byte_t*)&ICMPH(checksum);
+       sum=((uint16_t)c[0]<<8)|c[1];
+       sum+=0x0800;
+       if (sum<0x0800) sum++;
+       c[0]=sum>>8; c[1]=sum;
 
        // Send immediately
-       eth_tx_len=14+data_size;
-       eth_packet_send();
+       if (eth_reply(14+data_size,(byte_t*)&_header,20+4)) eth_packet_send();
      }
    }
 #endif   
@@ -942,18 +1064,14 @@ done:
 #ifdef DEBUG_ACK
       debug_msg("scheduling nwk_upstream 0 0");
 #endif
-      task_cancel(nwk_upstream);
-      task_add(nwk_upstream, 0, 0,"upstream");
+      task_ensure(nwk_upstream, 0, 0, TASK_NWK_UPSTREAM);
    }
 
    /*
     * Verify event processing.
     * Add socket management task.
     */
-   if(ev != WEEIP_EV_NONE) {
-     _sckt->callback(ev);
-     remove_rx_data(_sckt);
-   }
+   if(ev != WEEIP_EV_NONE) nwk_post_event(_sckt, ev);
 
 drop:
    return;
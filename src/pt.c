@@ -0,0 +1,117 @@
+/**
+ * @file pt.c
+ * @brief Protothreads on top of the task scheduler.
+ * @compiler CC65
+ * @author Paul Gardner-Stephen (paul@m-e-g-a.org)
+ */
+
+#include "defs.h"
+#include "task.h"
+#include "pt.h"
+
+/**
+ * Prepare a protothread.
+ * @param pt Thread state.
+ * @param fun Thread body.
+ * @param id Task identifier to run the thread under.
+ */
+void
+pt_init
+   (pt_t *pt,
+    task_t fun,
+    task_id_t id)
+{
+   pt->lc = 0;
+   pt->events = 0;
+   pt->timer = FALSE;
+   pt->fun = fun;
+   pt->id = id;
+}
+
+/**
+ * Start (or restart) a protothread from the top.
+ * @param pt Thread state.
+ */
+void
+pt_start
+   (pt_t *pt)
+{
+   pt->lc = 0;
+   pt->events = 0;
+   pt->timer = FALSE;
+   task_add(pt->fun, 0, 0, pt->id);
+}
+
+/**
+ * Deliver a socket event to a protothread, and have it run soon.
+ * @param pt Thread state.
+ * @param ev Event (WEEIP_EV_NONE just wakes the thread).
+ */
+void
+pt_wake
+   (pt_t *pt,
+    byte_t ev)
+{
+   if(ev == WEEIP_EV_DISCONNECT_WITH_DATA)
+      pt->events |= PT_EV_BIT(WEEIP_EV_DATA) | PT_EV_BIT(WEEIP_EV_DISCONNECT);
+   else if(ev != WEEIP_EV_NONE) pt->events |= PT_EV_BIT(ev);
+   task_ensure(pt->fun, 0, 0, pt->id);
+}
+
+/**
+ * Consume a received event.
+ * @param pt Thread state.
+ * @param ev Event.
+ * @return TRUE if the event had been received.
+ */
+bool_t
+pt_event
+   (pt_t *pt,
+    byte_t ev)
+{
+   if(!(pt->events & PT_EV_BIT(ev))) return FALSE;
+   pt->events &= ~PT_EV_BIT(ev);
+   return TRUE;
+}
+
+/**
+ * Arm the timeout of a wait.
+ * @param pt Thread state.
+ * @param ms Timeout, in milliseconds.
+ */
+void
+pt_timer_set
+   (pt_t *pt,
+    uint16_t ms)
+{
+   pt->deadline = ticks.d + ms;
+   pt->timer = TRUE;
+}
+
+/**
+ * Check the timeout of a wait.
+ * @param pt Thread state.
+ * @return TRUE if the timeout is armed and has expired.
+ */
+bool_t
+pt_timer_expired
+   (pt_t *pt)
+{
+   if(!pt->timer) return FALSE;
+   return (int32_t)(ticks.d - pt->deadline) >= 0;
+}
+
+/**
+ * Suspend a thread in a timed wait.
+ * Makes sure the thread runs again when the timeout expires; an earlier
+ * pt_wake() just re-checks the wait condition.
+ * @param pt Thread state.
+ * @return PT_WAITING.
+ */
+byte_t
+pt_timer_wait
+   (pt_t *pt)
+{
+   task_ensure(pt->fun, (uint16_t)(pt->deadline - ticks.d), 0, pt->id);
+   return PT_WAITING;
+}
@@ -38,6 +38,7 @@
 #include "weeip.h"
 #include "arp.h"
 #include "eth.h"
+#include "warmstart.h"
 
 #include "random.h"
 
@@ -208,8 +209,7 @@ socket_connect
    _sckt->state = _SYN_SENT;
    _sckt->toSend = SYN;
    _sckt->retry = RETRIES_TCP;
-   task_cancel(nwk_upstream);
-   task_add(nwk_upstream, 0, 0,"upstream");
+   task_ensure(nwk_upstream, 0, 0, TASK_NWK_UPSTREAM);
    return TRUE;
 }
 
@@ -237,8 +237,7 @@ socket_send
    _sckt->tx_size = size;
    _sckt->toSend = ACK | PSH;
    _sckt->retry = RETRIES_TCP;
-   task_cancel(nwk_upstream);
-   task_add(nwk_upstream, 0, 0,"upstream");
+   task_ensure(nwk_upstream, 0, 0, TASK_NWK_UPSTREAM);
    return TRUE;
 }
 
@@ -279,8 +278,7 @@ socket_disconnect()
    _sckt->toSend = FIN | ACK;
    _sckt->retry = RETRIES_TCP;
 
-   task_cancel(nwk_upstream);
-   task_add(nwk_upstream, 0, 0,"upstream");
+   task_ensure(nwk_upstream, 0, 0, TASK_NWK_UPSTREAM);
    return TRUE;
 }
 
@@ -294,23 +292,30 @@ socket_reset()
    if(_sckt->type != SOCKET_TCP) return;
    if(_sckt->state != _IDLE) {
       _sckt->toSend = RST;
-      task_cancel(nwk_upstream);
-      task_add(nwk_upstream, 0, 0,"upstream");
+      task_ensure(nwk_upstream, 0, 0, TASK_NWK_UPSTREAM);
    }
    _sckt->state = _IDLE;
 }
 
 /**
  * Network system initialization.
+ * Also sets up the task scheduler, so it must come before any task_add().
  */
 void 
 weeip_init()
 {
+   task_init();
    memset(_sockets, 0, sizeof(_sockets));
    _sckt = _sockets;
    port_used = PORT_MIN + (rand16(PORT_MAX - PORT_MIN+1));
    id = rand16(0);
-   task_add(nwk_tick, TICK_TCP, 0,"nwktick");
+   task_add(nwk_tick, TICK_TCP, 0, TASK_NWK_TICK);
    eth_init();
+   task_add(eth_link_task, 0, 0, TASK_ETH_LINK);
    arp_init();
+
+   /*
+    * Pick up where an earlier run left off, if it was not long ago.
+    */
+   warmstart_restore();
 }
@@ -16,7 +16,9 @@
 //#define DEBUG_TASKS
 // Show each task as it is called
 //#define DEBUG_TASK_CALLS
-//#define DEBUG_NAMED_TASK "ethtask"
+//#define DEBUG_TASK_ID TASK_ETH
+// Per-task run statistics are collected when TASK_PROFILE is defined
+// project-wide (see TCPDEFS in the Makefile).
 
 /********************************************************************************
  ********************************************************************************
@@ -46,55 +48,241 @@
 
 #include <string.h>
 #include "task.h"
+#include "memory.h"
 
 /**
- * Go into sleep mode when all tasks were executed.
+ * Time counter, in milliseconds.
+ * Brought up to date with the hardware timebase on every call to tick().
  */
-//#define _SLEEP
+volatile _uint32_t ticks;
+
+/*
+ * Hardware timebase.
+ * CIA 2 timer A divides the phi2 clock down to 1ms, and timer B counts
+ * its underflows, giving a 16-bit millisecond counter that keeps running
+ * whatever the application is doing.  The CIAs count at the C64 phi2 rate
+ * (PAL or NTSC) regardless of the CPU speed.
+ */
+#define CIA2_TA         0xDD04
+#define CIA2_TB         0xDD06
+#define CIA2_ICR        0xDD0D
+#define CIA2_CRA        0xDD0E
+#define CIA2_CRB        0xDD0F
+
+#define CYCLES_PER_MS_PAL     985
+#define CYCLES_PER_MS_NTSC    1023
+
+static uint16_t _cycles_per_ms;
+static uint16_t _last_ms;
 
 /**
- * Time counter.
+ * Task list, indexed by task identifier.
  */
-volatile _uint32_t ticks;
+tid_t _tasks[NTASKS];
 
 /*
- *  Exponential byte timing for a 10ms timebase (in seconds).
- * .===========================================================================.
- * |     |   0  |   1  |   2  |   3  |   4  |   5  |   6  |   7  |   8  |   9  |
- * |===========================================================================|
- * | 000 |    0 |  .01 |  .02 |  .03 |  .04 |  .05 |  .06 |  .07 |  .08 |  .09 |
- * | 010 |   .1 |  .11 |  .12 |  .13 |  .14 |  .15 |  .17 |  .19 |  .21 |  .23 |
- * | 020 |  .25 |  .27 |  .29 |  .31 |  .33 |  .35 |  .37 |  .39 |  .41 |  .43 |
- * | 030 |  .45 |  .47 |  .51 |  .55 |  .59 |  .63 |  .67 |  .71 |  .75 |  .79 |
- * | 040 |  .83 |  .87 |  .91 |  .95 |  .99 | 1.03 | 1.07 | 1.11 | 1.15 | 1.19 |
- * | 050 | 1.23 | 1.27 | 1.31 | 1.35 | 1.39 | 1.43 | 1.47 | 1.51 | 1.55 | 1.59 |
- * | 060 | 1.63 | 1.67 | 1.71 | 1.75 | 1.83 | 1.91 | 1.99 | 2.07 | 2.15 | 2.23 |
- * | 070 | 2.31 | 2.39 | 2.47 | 2.55 | 2.63 | 2.71 | 2.79 | 2.87 | 2.95 | 3.03 |
- * | 080 | 3.11 | 3.19 | 3.27 | 3.35 | 3.43 | 3.51 | 3.59 | 3.67 | 3.75 | 3.83 |
- * | 090 | 3.91 | 3.99 | 4.07 | 4.15 | 4.23 | 4.31 | 4.39 | 4.47 | 4.55 | 4.63 |
- * | 100 | 4.71 | 4.79 | 4.87 | 4.95 | 5.03 | 5.11 | 5.19 | 5.27 | 5.35 | 5.43 |
- * | 110 | 5.51 | 5.59 | 5.67 | 5.75 | 5.83 | 5.91 | 5.99 | 6.07 | 6.15 | 6.23 |
- * | 120 | 6.31 | 6.39 | 6.47 | 6.55 | 6.63 | 6.71 | 6.79 | 6.87 | 7.03 | 7.19 |
- * | 130 | 7.35 | 7.51 | 7.67 | 7.83 | 7.99 | 8.15 | 8.31 | 8.47 | 8.63 | 8.79 |
- * | 140 | 8.95 | 9.11 | 9.27 | 9.43 | 9.59 | 9.75 | 9.91 | 10.1 | 10.2 | 10.4 |
- * | 150 | 10.5 | 10.7 | 10.9 | 11.0 | 11.2 | 11.3 | 11.5 | 11.7 | 11.8 | 12.0 |
- * | 160 | 12.1 | 12.3 | 12.5 | 12.6 | 12.8 | 12.9 | 13.1 | 13.3 | 13.4 | 13.6 |
- * | 170 | 13.7 | 13.9 | 14.1 | 14.2 | 14.4 | 14.5 | 14.7 | 14.9 | 15.0 | 15.2 |
- * | 180 | 15.3 | 15.5 | 15.7 | 15.8 | 16.0 | 16.1 | 16.3 | 16.5 | 16.6 | 16.8 |
- * | 190 | 16.9 | 17.1 | 17.3 | 17.4 | 17.6 | 17.7 | 17.9 | 18.1 | 18.2 | 18.4 |
- * | 200 | 18.5 | 18.7 | 18.9 | 19.0 | 19.2 | 19.3 | 19.5 | 19.7 | 19.8 | 20.0 |
- * | 210 | 20.1 | 20.3 | 20.5 | 20.6 | 20.8 | 20.9 | 21.1 | 21.3 | 21.4 | 21.6 |
- * | 220 | 21.7 | 21.9 | 22.1 | 22.2 | 22.4 | 22.5 | 22.7 | 22.9 | 23.0 | 23.2 |
- * | 230 | 23.3 | 23.5 | 23.7 | 23.8 | 24.0 | 24.1 | 24.3 | 24.5 | 24.6 | 24.8 |
- * | 240 | 24.9 | 25.1 | 25.3 | 25.4 | 25.6 | 25.7 | 25.9 | 26.1 | 26.2 | 26.4 |
- * | 250 | 26.5 | 26.7 | 26.9 | 27.0 | 27.2 | 27.3 |      |      |      |      |
- * '==========================================================================='
- */
-
-/**
- * Task list.
- */
-volatile tid_t _tasks[NTASKS];
+ * Scheduler lists.
+ * Doubly linked through the next/prev fields of _tasks, so that tasks can
+ * be inserted and removed in constant time.
+ */
+static byte_t _head[TASK_LISTS];
+static byte_t _tail[TASK_LISTS];
+static byte_t _count[TASK_LISTS];
+static byte_t _ready_count;
+
+/**
+ * Priority class of each task identifier.
+ */
+#define TASK_PRIO_OF(id, prio, name)   prio,
+static const byte_t _task_prio[NTASKS] = {
+   TASK_TABLE(TASK_PRIO_OF)
+};
+
+/*
+ * Earliest due time of the tasks in the timer wheel.
+ * Only valid while _wheel_count is non-zero and _next_due_stale is FALSE.
+ */
+static byte_t _wheel_count;
+static uint32_t _next_due;
+static bool_t _next_due_stale;
+
+/**
+ * Read a CIA 2 timer.
+ * The two halves are read again if the high byte changed meanwhile.
+ * @param reg Address of the timer low byte.
+ * @return Current timer value.
+ */
+static uint16_t
+cia2_timer
+   (uint16_t reg)
+{
+   static byte_t h, l;
+
+   do {
+      h = PEEK(reg+1);
+      l = PEEK(reg);
+   } while(h != PEEK(reg+1));
+   return ((uint16_t)h << 8) | l;
+}
+
+/**
+ * Start the hardware timebase.
+ */
+static void
+task_clock_init()
+{
+   _cycles_per_ms = (PEEK(0xD06F) & 0x80) ? CYCLES_PER_MS_NTSC : CYCLES_PER_MS_PAL;
+
+   /*
+    * No NMIs from either timer.
+    */
+   POKE(CIA2_ICR, 0x03);
+
+   POKE(CIA2_TA, (byte_t)(_cycles_per_ms - 1));
+   POKE(CIA2_TA+1, (byte_t)((_cycles_per_ms - 1) >> 8));
+   POKE(CIA2_TB, 0xFF);
+   POKE(CIA2_TB+1, 0xFF);
+   POKE(CIA2_CRA, 0x11);                  // Continuous, load, start.
+   POKE(CIA2_CRB, 0x51);                  // Count timer A underflows, load, start.
+
+   _last_ms = 0xFFFF;
+}
+
+#ifdef TASK_PROFILE
+/**
+ * Run statistics, indexed by task identifier.
+ */
+static task_profile_t _task_profile[NTASKS];
+uint16_t task_profile_add_failed;
+uint16_t task_profile_rescheduled;
+
+#define TASK_NAME_OF(id, prio, name)   name,
+static const char *_task_names[NTASKS] = {
+   TASK_TABLE(TASK_NAME_OF)
+};
+
+/**
+ * Profiling clock reading: milliseconds (timer B, counting up) and
+ * cycles into the current millisecond (timer A phase).
+ */
+typedef struct {
+   uint16_t ms;
+   uint16_t sub;
+} task_profile_time_t;
+
+/**
+ * Read the profiling clock.
+ * @param t Reading.
+ */
+static void
+task_profile_clock
+   (task_profile_time_t *t)
+{
+   static uint16_t ms;
+
+   do {
+      ms = cia2_timer(CIA2_TB);
+      t->sub = _cycles_per_ms - 1 - cia2_timer(CIA2_TA);
+   } while(ms != cia2_timer(CIA2_TB));
+   t->ms = ~ms;
+}
+
+/**
+ * Time elapsed since a reading.
+ * The millisecond difference is taken modulo the 16-bit counter before
+ * scaling, so that runs across a counter wrap are measured correctly.
+ * @param t Earlier reading.
+ * @return CIA cycles.
+ */
+static uint32_t
+task_profile_elapsed
+   (task_profile_time_t *t)
+{
+   static task_profile_time_t now;
+
+   task_profile_clock(&now);
+   return (uint32_t)(uint16_t)(now.ms - t->ms) * _cycles_per_ms + now.sub - t->sub;
+}
+
+/**
+ * Get the run statistics of a task.
+ * @param id Task identifier.
+ * @return Statistics, or NULL for an invalid identifier.
+ */
+task_profile_t *
+task_profile
+   (task_id_t id)
+{
+   if(id >= NTASKS) return NULL;
+   return &_task_profile[id];
+}
+
+/**
+ * Clear all statistics.
+ */
+void
+task_profile_reset()
+{
+   memset(_task_profile, 0, sizeof(_task_profile));
+   task_profile_add_failed = 0;
+   task_profile_rescheduled = 0;
+}
+
+/**
+ * Print the statistics of all tasks that ran.
+ */
+void
+task_profile_dump()
+{
+   byte_t id;
+   task_profile_t *p;
+
+   printf("task       calls    cycles   max  late\n");
+   for(id=0;id<NTASKS;id++) {
+      p = &_task_profile[id];
+      if(!p->calls) continue;
+      printf("%-9s %6u %9lu %5lu %5u\n",
+             _task_names[id], p->calls, p->cycles, p->max_cycles, p->max_late);
+   }
+   printf("add failed %u, rescheduled %u\n",
+          task_profile_add_failed, task_profile_rescheduled);
+}
+#endif
+
+/*
+ * Requests posted by interrupt handlers.
+ * Single producer (the interrupt handlers) and single consumer
+ * (task_periodic()): only i_task_*() advance _irq_head, and only
+ * task_irq_drain() advances _irq_tail, so no locking is needed.
+ * An entry with a NULL function is a cancellation.
+ */
+static task_t _irq_fun[TASK_IRQ_QUEUE];
+static uint16_t _irq_tempo[TASK_IRQ_QUEUE];
+static byte_t _irq_par[TASK_IRQ_QUEUE];
+static byte_t _irq_id[TASK_IRQ_QUEUE];
+static volatile byte_t _irq_head;
+static volatile byte_t _irq_tail;
+volatile uint16_t task_irq_overflows;
+
+/*
+ * Frame-budgeted mode: task_periodic_frame() runs one full scheduler pass
+ * per frame, and receive/transmit-only passes after it, while the raster
+ * is within _frame_lines lines from _frame_first.
+ */
+static uint16_t _frame_first;
+static uint16_t _frame_lines;
+static bool_t _frame_active = FALSE;
+static bool_t _frame_ran = FALSE;      // A pass already ran in this frame.
+static uint16_t _frame_line;           // Raster line at the previous call.
+static uint32_t _frame_pass;           // Value of ticks at the last pass.
+static byte_t _frame_prios = TASK_PRIOS; // Priority classes a pass may run.
+
+/*
+ * Shortest frame (NTSC), in milliseconds: a pass that ran longer ago
+ * than this was in an earlier frame, even if the raster line did not
+ * show it.
+ */
+#define TASK_FRAME_MS      16
 
 /**
  * Sleep task.
@@ -103,8 +291,9 @@ static task_t _task_sleep = NULL;
 
 /**
  * Define a task to be run during sleep time.
- * It will be called after the periodic action of the watchdog-timer.
- * @param f Task address.
+ * It is called by task_periodic() whenever no task is ready, with the
+ * number of milliseconds until the next task is due (at most 255) as parameter.
+ * @param f Task address, or NULL to remove it.
  */
 void
 task_sleep
@@ -113,80 +302,187 @@ task_sleep
    _task_sleep = f;
 }
 
+/**
+ * Remove a task from the list holding it, if any.
+ * @param id Task identifier.
+ */
+static void
+task_unlink
+   (byte_t id)
+{
+   static tid_t *task;
+   static byte_t l;
+
+   task = &_tasks[id];
+   l = task->list;
+   if(l == TASK_LIST_NONE) return;
+
+   if(task->prev == TASK_LIST_NONE) _head[l] = task->next;
+   else _tasks[task->prev].next = task->next;
+   if(task->next == TASK_LIST_NONE) _tail[l] = task->prev;
+   else _tasks[task->next].prev = task->prev;
+
+   _count[l]--;
+   task->list = TASK_LIST_NONE;
+
+   if(l < TASK_WHEEL_SIZE) {
+      _wheel_count--;
+      if(task->due == _next_due) _next_due_stale = TRUE;
+   } else _ready_count--;
+}
+
+/**
+ * Append a task to the end of a list.
+ * @param id Task identifier.
+ * @param l List number.
+ */
+static void
+task_link
+   (byte_t id,
+    byte_t l)
+{
+   static tid_t *task;
+
+   task = &_tasks[id];
+   task->list = l;
+   task->next = TASK_LIST_NONE;
+   task->prev = _tail[l];
+   if(_tail[l] == TASK_LIST_NONE) _head[l] = id;
+   else _tasks[_tail[l]].next = id;
+   _tail[l] = id;
+   _count[l]++;
+
+   if(l < TASK_WHEEL_SIZE) {
+      if((!_wheel_count) || ((int32_t)(task->due - _next_due) < 0)) _next_due = task->due;
+      _wheel_count++;
+   } else _ready_count++;
+}
+
+/**
+ * Recalculate the earliest due time of the tasks in the timer wheel.
+ */
+static void
+task_next_due_update()
+{
+   static byte_t id;
+   static bool_t first;
+
+   first = TRUE;
+   for(id=0;id<NTASKS;id++) {
+      if(_tasks[id].list >= TASK_WHEEL_SIZE) continue;
+      if(first || ((int32_t)(_tasks[id].due - _next_due) < 0)) {
+         _next_due = _tasks[id].due;
+         first = FALSE;
+      }
+   }
+   _next_due_stale = FALSE;
+}
+
+/**
+ * Time until the scheduler next has work to do.
+ * Lets the application know how long it can spend on other things before
+ * task_periodic() needs to be called again.
+ * @return Milliseconds until the next task is due, 0 if a task is ready now,
+ * or TASK_IDLE_FOREVER if no task is pending.
+ */
+uint16_t
+task_idle_time()
+{
+   static uint32_t d;
+
+   if(_ready_count) return 0;
+   if(!_wheel_count) return TASK_IDLE_FOREVER;
+   if(_next_due_stale) task_next_due_update();
+
+   d = _next_due - ticks.d;
+   if((int32_t)d <= 0) return 0;
+   if(d >= TASK_IDLE_FOREVER) return TASK_IDLE_FOREVER-1;
+   return (uint16_t)d;
+}
+
 /**
  * Create a task for execution.
+ * If the task is already pending, it is rescheduled with the new
+ * parameters, so there is never more than one instance of it.
  * @param f Task address.
- * @param time Time to call (0 = immediate).
+ * @param tempo Time to call, in milliseconds (0 = immediate).
  * @param par Task parameter.
+ * @param id Task identifier.
  * @return TRUE if successful.
  */
 bool_t 
 task_add
    (task_t f, 
-    byte_t tempo, 
+    uint16_t tempo, 
     byte_t par,
-    char *name)
+    task_id_t id)
 {
-   bool_t ok;
-   volatile tid_t *task;
-   uint8_t j;
+   tid_t *task;
 
-   if(f == NULL) return FALSE;
-
-   /*
-    * Search the task list for an empty slot.
-    */
-   ok = FALSE;
-   for(j=0;j<NTASKS;j++) {
-     task=&_tasks[j];
-     if(task->fun == NULL) {
-       /*
-	* Empty slot found.
-	* Save task information.
-	*/
-       task->fun = f;
-       task->par = par;
-       task->tmr = tempo;
-       strncpy(task->name,name,8);
-       task->name[8]=0;
-       ok = TRUE;
-       break;
-     }
+   if((f == NULL) || (id >= NTASKS)) {
+#ifdef TASK_PROFILE
+      task_profile_add_failed++;
+#endif
+      return FALSE;
    }
 
-   return ok;
+   task = &_tasks[id];
+#ifdef TASK_PROFILE
+   if(task->list != TASK_LIST_NONE) task_profile_rescheduled++;
+#endif
+   task_unlink(id);
+   task->fun = f;
+   task->par = par;
+   task->due = ticks.d + tempo;
+
+   if(tempo == 0) task_link(id, TASK_LIST_READY + _task_prio[id]);
+   else task_link(id, (byte_t)task->due & (TASK_WHEEL_SIZE-1));
+
+   return TRUE;
 }
 
 /**
- * Cancel the execution of a task.
+ * Make sure a task runs no later than tempo milliseconds from now.
+ * A pending task keeps its parameter and is only ever moved earlier;
+ * otherwise the task is added as by task_add().
  * @param f Task address.
- * @return FALSE if the task was already called.
+ * @param tempo Latest time to call, in milliseconds (0 = immediate).
+ * @param par Task parameter, if the task is not already pending.
+ * @param id Task identifier.
+ * @return TRUE if successful.
  */
-bool_t 
-task_cancel
-   (task_t f)
+bool_t
+task_ensure
+   (task_t f,
+    uint16_t tempo,
+    byte_t par,
+    task_id_t id)
 {
-  volatile tid_t *task;
-   bool_t ok;
-   
+   tid_t *task;
+
    if(f == NULL) return FALSE;
+   if(id >= NTASKS) return FALSE;
 
-   /*
-    * Search for the task in the list.
-    */
-   ok = FALSE;
-   for_each(_tasks, task) {
-      if(task->fun == f) {
-         /*
-          * Found. Remove it.
-          */
-         task->fun = NULL;
-         ok = TRUE;
-         break;
-      }
-   }
+   task = &_tasks[id];
+   if(task->list == TASK_LIST_NONE) return task_add(f, tempo, par, id);
+   if(task->list >= TASK_LIST_READY) return TRUE;
+   if((int32_t)(task->due - (ticks.d + tempo)) <= 0) return TRUE;
+   return task_add(f, tempo, task->par, id);
+}
 
-   return ok;
+/**
+ * Cancel the execution of a task.
+ * @param id Task identifier.
+ * @return FALSE if the task was not pending.
+ */
+bool_t 
+task_cancel
+   (task_id_t id)
+{
+   if(id >= NTASKS) return FALSE;
+   if(_tasks[id].list == TASK_LIST_NONE) return FALSE;
+   task_unlink(id);
+   return TRUE;
 }
 
 /**
@@ -195,50 +491,228 @@ task_cancel
 void 
 task_cancel_all()
 {
-  volatile tid_t *task;
+  byte_t id;
   printf("Cancel all tasks.\n");
-   for_each(_tasks, task) {
-      task->fun = NULL;
+  for(id=0;id<NTASKS;id++) task_unlink(id);
+}
+
+/**
+ * Post a request to the interrupt queue.
+ * @return FALSE if the queue is full.
+ */
+static bool_t
+task_irq_post
+   (task_t f,
+    uint16_t tempo,
+    byte_t par,
+    task_id_t id)
+{
+   byte_t h, next;
+
+   h = _irq_head;
+   next = (h + 1) & (TASK_IRQ_QUEUE-1);
+   if(next == _irq_tail) {
+      task_irq_overflows++;
+      return FALSE;
    }
+   _irq_fun[h] = f;
+   _irq_tempo[h] = tempo;
+   _irq_par[h] = par;
+   _irq_id[h] = id;
+
+   /*
+    * Publish the entry only once it is complete.
+    */
+   _irq_head = next;
+   return TRUE;
 }
 
 /**
- * Time interrupt handler.
- * Must be called by the interrupt thread.
+ * Schedule a task from an interrupt handler.
+ * The request is queued and applied by the next task_periodic() pass
+ * as task_ensure(), so it can only move a pending task earlier.
+ * Must not be called from the main program.
+ * @param f Task address.
+ * @param tempo Latest time to call, in milliseconds (0 = immediate).
+ * @param par Task parameter, if the task is not already pending.
+ * @param id Task identifier.
+ * @return FALSE if the queue is full.
+ */
+bool_t
+i_task_add
+   (task_t f,
+    uint16_t tempo,
+    byte_t par,
+    task_id_t id)
+{
+   if(f == NULL) return FALSE;
+   return task_irq_post(f, tempo, par, id);
+}
+
+/**
+ * Cancel a task from an interrupt handler.
+ * Queued like i_task_add(), and applied in order with it.
+ * @param id Task identifier.
+ * @return FALSE if the queue is full.
+ */
+bool_t
+i_task_cancel
+   (task_id_t id)
+{
+   return task_irq_post(NULL, 0, 0, id);
+}
+
+/**
+ * Set the raster window for task_periodic_frame().
+ * first+lines must not go past the last raster line of the frame.
+ * @param first First raster line on which tasks may run.
+ * @param lines Number of raster lines per frame tasks may use
+ * (0 = no limit).
+ */
+void
+task_frame_window
+   (uint16_t first,
+    uint16_t lines)
+{
+   _frame_first = first;
+   _frame_lines = lines;
+}
+
+/**
+ * Apply the requests posted by interrupt handlers.
+ */
+static void
+task_irq_drain()
+{
+   static byte_t t;
+
+   t = _irq_tail;
+   while(t != _irq_head) {
+      if(_irq_fun[t] == NULL) task_cancel(_irq_id[t]);
+      else task_ensure(_irq_fun[t], _irq_tempo[t], _irq_par[t], _irq_id[t]);
+      t = (t + 1) & (TASK_IRQ_QUEUE-1);
+
+      /*
+       * Free the entry only after it was read.
+       */
+      _irq_tail = t;
+   }
+}
+
+/**
+ * Read the current raster line.
+ */
+static uint16_t
+task_raster_line()
+{
+   return PEEK(0xD012) | ((uint16_t)(PEEK(0xD011) & 0x80) << 1);
+}
+
+/**
+ * Check if the raster is within the task window.
+ * @return TRUE if tasks may run.
+ */
+static bool_t
+task_in_frame_window()
+{
+   return (uint16_t)(task_raster_line() - _frame_first) < _frame_lines;
+}
+
+/**
+ * Frame-budgeted main loop.
+ * Runs a full scheduler pass once per frame, when the raster is in the
+ * window set by task_frame_window(), with low-priority tasks held to
+ * TASK_LOW_BUDGET as usual.  For the rest of the window it keeps running
+ * passes limited to the receive and transmit classes, so that ACKs and
+ * incoming data are not held back a whole frame.  Passes stop when the
+ * raster leaves the window, so the rest of the frame belongs to the
+ * application.  Ready tasks that did not fit stay ready, highest priority
+ * first, for the next frame.
+ * Outside the window only the time is updated.
+ */
+void
+task_periodic_frame(void)
+{
+   static uint16_t line;
+
+   if(!_frame_lines) {
+     task_periodic();
+     return;
+   }
+
+   tick();
+   line = task_raster_line();
+   if((line < _frame_line) || ((ticks.d - _frame_pass) >= TASK_FRAME_MS))
+     _frame_ran = FALSE;                  // new frame
+   _frame_line = line;
+   if((uint16_t)(line - _frame_first) >= _frame_lines) return;
+
+   _frame_active = TRUE;
+   if(!_frame_ran) {
+     _frame_ran = TRUE;
+     _frame_pass = ticks.d;
+     task_periodic();
+   }
+
+   _frame_prios = TASK_PRIO_TIMER;
+   for(;;) {
+     if(_irq_tail != _irq_head) task_irq_drain();
+     if(!_count[TASK_LIST_READY + TASK_PRIO_RX]
+        && !_count[TASK_LIST_READY + TASK_PRIO_TX]) break;
+     if(!task_in_frame_window()) break;
+     task_periodic();
+   }
+   _frame_prios = TASK_PRIOS;
+   _frame_active = FALSE;
+}
+
+/**
+ * Time update.
+ * Advances the time counter by the milliseconds elapsed since the last
+ * call, and moves the tasks that became due from their timer wheel
+ * buckets to the ready list.
+ * Must be called at least once every 65 seconds.
  */
 void 
 tick()
 {
-  volatile static tid_t *task;
-   static byte_t tmp;
+   static byte_t id, next, b, n;
+   static uint16_t now, elapsed;
 
    /*
     * Update timing information.
     */
-   ticks.d++;
+   now = cia2_timer(CIA2_TB);
+   elapsed = _last_ms - now;
+   if(!elapsed) return;
+   _last_ms = now;
+   ticks.d += elapsed;
 
    /*
-    * Update task timing information.
+    * Nothing to do until the earliest pending task is due.
     */
-   for_each(_tasks, task) {
-      if(task->fun == NULL) continue;              // unused.
-
-      tmp = task->tmr;
-      if(tmp == 0) continue;                       // no timing.
+   if(!_wheel_count) return;
+   if(_next_due_stale) task_next_due_update();
+   if((int32_t)(_next_due - ticks.d) > 0) return;
 
-      /*
-       * Exponential time algorithm.
-       */
-      if(tmp & 0x80) {
-         if(ticks.b[0] & 0x0f) continue;           // each 16 ticks.
-      } else if(tmp & 0xc0) {
-         if(ticks.b[0] & 0x07) continue;           // each 8 ticks.
-      } else if(tmp & 0xe0) {
-         if(ticks.b[0] & 0x03) continue;           // each 4 ticks.
-      } else if(tmp & 0xf0) {
-         if(ticks.b[0] & 0x01) continue;           // each 2 ticks.
+   /*
+    * Only the buckets of the milliseconds that just passed can hold tasks
+    * that became due, oldest first.
+    * Tasks more than a wheel turn away stay in their bucket.
+    */
+   n = (elapsed < TASK_WHEEL_SIZE) ? (byte_t)elapsed : TASK_WHEEL_SIZE;
+   b = ticks.b[0] - n + 1;
+   while(n--) {
+      id = _head[b & (TASK_WHEEL_SIZE-1)];
+      while(id != TASK_LIST_NONE) {
+         next = _tasks[id].next;
+         if((int32_t)(_tasks[id].due - ticks.d) <= 0) {
+            task_unlink(id);
+            task_link(id, TASK_LIST_READY + _task_prio[id]);
+         }
+         id = next;
       }
-      task->tmr = tmp-1;
+      b++;
    }
 }
 
@@ -248,11 +722,26 @@ tick()
 void 
 task_init()
 {
+   byte_t id;
+
    /*
     * Setup data structures.
     */
    memset((void*)_tasks, 0, sizeof(_tasks));
-
+   for(id=0;id<NTASKS;id++) _tasks[id].list = TASK_LIST_NONE;
+   memset(_head, TASK_LIST_NONE, sizeof(_head));
+   memset(_tail, TASK_LIST_NONE, sizeof(_tail));
+   memset(_count, 0, sizeof(_count));
+   _wheel_count = 0;
+   _ready_count = 0;
+   _next_due_stale = FALSE;
+   _irq_head = 0;
+   _irq_tail = 0;
+   task_irq_overflows = 0;
+   task_clock_init();
+#ifdef TASK_PROFILE
+   task_profile_reset();
+#endif
 }
 
 /**
@@ -262,60 +751,121 @@ task_init()
 void task_periodic(void)
 {
    static byte_t (*f)(byte_t);
-   volatile static tid_t *task;
-   static bool_t exe;
+   static tid_t *task;
+   static byte_t id, p;
+   static byte_t n[TASK_PRIOS];
+   static bool_t low_ran, rx_again;
+   static uint32_t low_start;
+   static uint16_t idle;
+#ifdef TASK_PROFILE
+   static task_profile_t *prof;
+   static uint32_t late, start;
+   static task_profile_time_t begin;
+#endif
 #ifdef DEBUG_TASK_CALLS
    static task_t last_task_fun = NULL;
    static unsigned char rev_toggle = 0x00;
 #endif
 #ifdef DEBUG_TASKS
    static char show_task_list_n=0;
-   if (!show_task_list_n) printf("Tasks=");
+   if (!show_task_list_n) {
+     printf("Tasks=");
+     for(id=0;id<NTASKS;id++)
+       if (_tasks[id].list != TASK_LIST_NONE) printf("%d,",id);
+     printf("\n");
+   }
 #endif
    
+   if(_irq_tail != _irq_head) task_irq_drain();
+
    /*
-    * Call pending tasks.
+    * Nothing ready: skip the pass, and let the sleep task use the time.
     */
-   exe = FALSE;
-   for_each(_tasks, task) {
-     f = task->fun;
-     if(f == NULL) continue;
+   if(!_ready_count) {
+     if(_task_sleep) {
+       idle = task_idle_time();
+       (*_task_sleep)(idle > 0xff ? 0xff : (byte_t)idle);
+     }
+     tick();
+     return;
+   }
 
-#ifdef DEBUG_TASKS
-     if (!show_task_list_n) printf("%s,",task->name);
-#endif
-     
-     /*
-      * Check task timing.
-      */
-     exe = TRUE;
-     if(task->tmr) continue;
+   /*
+    * Call the tasks that were ready when the pass started, highest
+    * priority first.  Tasks made ready while the pass runs wait for the
+    * next one, except receive tasks, which get another go before each
+    * low-priority task so the controller's RX ring keeps draining.
+    * Classes from _frame_prios on are skipped (frame mode, after the
+    * frame's full pass).
+    */
+   for(p=0;p<TASK_PRIOS;p++)
+     n[p] = (p < _frame_prios) ? _count[TASK_LIST_READY + p] : 0;
+   low_ran = FALSE;
+   rx_again = FALSE;
+   low_start = ticks.d;
+   for(;;) {
+     for(p=0;p<TASK_PRIOS;p++)
+       if(n[p] && _count[TASK_LIST_READY + p]) break;
+     if(p == TASK_PRIOS) break;
+     if(_frame_active && !task_in_frame_window()) break;
+
+     if(p >= TASK_PRIO_TIMER) {
+       if(low_ran) {
+         /*
+          * Low-priority work is limited to TASK_LOW_BUDGET per pass;
+          * what is left stays ready for the next pass.
+          */
+         tick();
+         if((ticks.d - low_start) >= TASK_LOW_BUDGET) break;
+       }
+       if((!rx_again) && _count[TASK_LIST_READY + TASK_PRIO_RX]) {
+         n[TASK_PRIO_RX] = _count[TASK_LIST_READY + TASK_PRIO_RX];
+         rx_again = TRUE;
+         continue;
+       }
+       rx_again = FALSE;
+       low_ran = TRUE;
+     }
+     n[p]--;
+     id = _head[TASK_LIST_READY + p];
+     task = &_tasks[id];
+     f = task->fun;
 
 #ifdef DEBUG_TASK_CALLS
-#ifdef DEBUG_NAMED_TASK
-     if (strstr(DEBUG_NAMED_TASK,task->name)) {
+#ifdef DEBUG_TASK_ID
+     if (id == DEBUG_TASK_ID) {
 #endif
      if (task->fun!=last_task_fun) {
-       printf("[Task:%s]",task->name);
+       printf("[Task:%d]",id);
        last_task_fun=task->fun;
      } else {
        // Show blinking cursor as function is repeatedly called
        printf("%c %c%c",0x12+rev_toggle,0x9d,0x92);
        rev_toggle^=0x80;
      }
-#endif
-#ifdef DEBUG_NAMED_TASK
+#ifdef DEBUG_TASK_ID
      }
+#endif
 #endif
      /*
       * Task is ready.
       * Remove from the list and run.
       */
-     task->fun = NULL;
+#ifdef TASK_PROFILE
+     prof = &_task_profile[id];
+     late = ticks.d - task->due;
+     if(late > 0xffff) late = 0xffff;
+     if((uint16_t)late > prof->max_late) prof->max_late = (uint16_t)late;
+     task_profile_clock(&begin);
+#endif
+     task_unlink(id);
      (*f)(task->par);
+#ifdef TASK_PROFILE
+     start = task_profile_elapsed(&begin);
+     prof->calls++;
+     prof->cycles += start;
+     if(start > prof->max_cycles) prof->max_cycles = start;
+#endif
    }
    tick();
-#ifdef DEBUG_TASKS
-   if (!show_task_list_n) printf("\n");
-#endif
 }
@@ -0,0 +1,204 @@
+/**
+ * @file warmstart.c
+ * @brief Snapshot of the learned network state, kept across program runs.
+ * @compiler CC65
+ * @author Paul Gardner-Stephen (paul@m-e-g-a.org)
+ *
+ * The DHCP configuration and lease, the resolved ARP entries and the DNS
+ * cache are saved to attic RAM as they change. weeip_init() restores
+ * them if they belong to this machine and the lease is still good for a
+ * while, so that a program started again a short time later can talk
+ * almost straight away. The restored address is first probed with ARP:
+ * if another host answers for it, the snapshot is dropped and DHCP runs
+ * as usual. Restored ARP entries are queried again in the background,
+ * and dropped if they do not answer.
+ */
+
+#include <string.h>
+
+#include "weeip.h"
+#include "eth.h"
+#include "arp.h"
+#include "dns.h"
+#include "dhcp.h"
+#include "warmstart.h"
+
+#include "memory.h"
+#include "time.h"
+
+#define WARMSTART_MAGIC "WIP1"
+
+typedef struct {
+   IPV4 ip;
+   EUI48 mac;
+} WARMSTART_ARP_ENTRY;
+
+/**
+ * Snapshot layout.
+ */
+typedef struct {
+   char magic[4];                         ///< WARMSTART_MAGIC.
+   uint16_t check;                        ///< Sum of the bytes that follow.
+   EUI48 mac;                             ///< Our MAC address.
+   uint32_t leased;                       ///< warmstart_clock() when the lease was obtained.
+   uint32_t lease;                        ///< Lease time, in seconds.
+   IPV4 ip_local;
+   IPV4 ip_mask;
+   IPV4 ip_gate;
+   IPV4 ip_dnsserver;
+   IPV4 ip_broadcast;
+   WARMSTART_ARP_ENTRY arp[WARMSTART_ARP];
+   DNS_CACHE_ENTRY dns[DNS_CACHE_SIZE];
+} WARMSTART;
+
+static WARMSTART ws;
+
+/**
+ * A restored configuration is being probed, and not in use yet.
+ */
+bool_t warmstart_pending = FALSE;
+
+static byte_t warmstart_probes;
+
+extern IPV4 ip_broadcast;
+
+/**
+ * Seconds from the real-time clock.
+ * Counts every month as 31 days, so it may run ahead across a month
+ * end, but never backwards: good enough to tell whether a lease or a DNS
+ * answer is still fresh.
+ */
+uint32_t warmstart_clock(void)
+{
+  struct m65_tm tm;
+  uint32_t days;
+
+  getrtc(&tm);
+  days=((uint32_t)tm.tm_year*12+tm.tm_mon)*31+tm.tm_mday;
+  return ((days*24+tm.tm_hour)*60+tm.tm_min)*60+tm.tm_sec;
+}
+
+/*
+ * Sum of the snapshot bytes after the check field.
+ */
+static uint16_t warmstart_sum(void)
+{
+  static uint16_t i, sum;
+  static byte_t *p;
+
+  sum=0;
+  p=(byte_t*)&ws.mac;
+  for(i=sizeof(ws.magic)+sizeof(ws.check);i<sizeof(ws);i++) sum+=*p++;
+  return sum;
+}
+
+/**
+ * Save the current state, if we are configured.
+ */
+void warmstart_save(void)
+{
+  static byte_t i, n;
+
+  if (!dhcp_configured) return;
+
+  memset(&ws,0,sizeof(ws));
+  memcpy(ws.magic,WARMSTART_MAGIC,sizeof(ws.magic));
+  memcpy(&ws.mac,&mac_local,sizeof(EUI48));
+  ws.leased=dhcp_leased;
+  ws.lease=dhcp_lease;
+  ws.ip_local.d=ip_local.d;
+  ws.ip_mask.d=ip_mask.d;
+  ws.ip_gate.d=ip_gate.d;
+  ws.ip_dnsserver.d=ip_dnsserver.d;
+  ws.ip_broadcast.d=ip_broadcast.d;
+
+  n=0;
+  for(i=0;(i<ARP_CACHE_SIZE)&&(n<WARMSTART_ARP);i++)
+    if (arp_entry(i,&ws.arp[n].ip,&ws.arp[n].mac)) n++;
+
+  memcpy(ws.dns,dns_cache,sizeof(ws.dns));
+
+  ws.check=warmstart_sum();
+  lcopy((uint32_t)&ws,WARMSTART_BASE,sizeof(ws));
+}
+
+/**
+ * Put the restored configuration in use.
+ */
+static void warmstart_apply(void)
+{
+  static byte_t i;
+
+  ip_local.d=ws.ip_local.d;
+  ip_mask.d=ws.ip_mask.d;
+  ip_gate.d=ws.ip_gate.d;
+  ip_dnsserver.d=ws.ip_dnsserver.d;
+  ip_broadcast.d=ws.ip_broadcast.d;
+  dhcp_leased=ws.leased;
+  dhcp_lease=ws.lease;
+
+  for(i=0;i<WARMSTART_ARP;i++)
+    if (ws.arp[i].ip.d) arp_restore(&ws.arp[i].ip,&ws.arp[i].mac);
+
+  dhcp_configured=1;
+  arp_configured();
+}
+
+/**
+ * Check task for a restored address.
+ * Probes it WARMSTART_PROBES times, WARMSTART_PROBE_TIME apart. If no
+ * other host claims it, the configuration goes live; otherwise the
+ * snapshot is dropped and DHCP starts from scratch.
+ */
+byte_t warmstart_probe(byte_t p)
+{
+  if (arp_conflict) {
+    arp_probe(NULL);
+    warmstart_pending=FALSE;
+    lfill(WARMSTART_BASE,0,sizeof(ws.magic));
+    dhcp_autoconfig();
+    return 0;
+  }
+
+  if (warmstart_probes<WARMSTART_PROBES) {
+    warmstart_probes++;
+    arp_probe(&ws.ip_local);
+    task_add(warmstart_probe,WARMSTART_PROBE_TIME,0,TASK_WARMSTART);
+    return 0;
+  }
+
+  arp_probe(NULL);
+  warmstart_pending=FALSE;
+  warmstart_apply();
+  return 0;
+}
+
+/**
+ * Restore the state saved by an earlier run.
+ * The DNS cache is restored on its own (its entries carry their own
+ * expiry); the configuration and ARP entries only while the lease is in
+ * its first half, and once warmstart_probe() found the address free.
+ * @return TRUE if the configuration was restored, so that DHCP can be
+ *         skipped (dhcp_autoconfig() waits for the probe meanwhile).
+ */
+bool_t warmstart_restore(void)
+{
+  static uint32_t now, lease;
+
+  lcopy(WARMSTART_BASE,(uint32_t)&ws,sizeof(ws));
+  if (memcmp(ws.magic,WARMSTART_MAGIC,sizeof(ws.magic))) return FALSE;
+  if (ws.check!=warmstart_sum()) return FALSE;
+  if (memcmp(&ws.mac,&mac_local,sizeof(EUI48))) return FALSE;
+
+  memcpy(dns_cache,ws.dns,sizeof(ws.dns));
+
+  now=warmstart_clock();
+  lease=ws.lease?ws.lease:WARMSTART_LEASE;
+  if ((now<ws.leased)||(now-ws.leased>=lease/2)) return FALSE;
+  if (!ws.ip_local.d) return FALSE;
+
+  warmstart_pending=TRUE;
+  warmstart_probes=0;
+  task_add(warmstart_probe,0,0,TASK_WARMSTART);
+  return TRUE;
+}
@@ -0,0 +1,101 @@
+// Test WeeIp checksum calculation
+// Checks ip_checksum_c() against reference checksums, and, when built with
+// CHECKSUM_45GS02, checks the 45GS02 kernel against the C version for every
+// length and alignment.
+
+#include <stdio.h>
+#include "memory.h"
+#include "checksum.h"
+
+unsigned char data[160];
+unsigned short failures=0;
+
+// Straightforward 16-bit big-endian word sum, used as the reference.
+unsigned short ref_checksum(unsigned char *p,unsigned short len)
+{
+    unsigned long sum=0;
+    unsigned short i;
+    for(i=0;i+1<len;i+=2) sum+=((unsigned short)p[i]<<8)|p[i+1];
+    if (len&1) sum+=(unsigned short)p[len-1]<<8;
+    while(sum>>16) sum=(sum&0xffff)+(sum>>16);
+    return sum;
+}
+
+void check(char *name,unsigned short expected)
+{
+    // chks holds the sum in network byte order
+    unsigned short got=((unsigned short)chks.b[0]<<8)|chks.b[1];
+    if (got!=expected) {
+        printf("FAIL %s: got %04x, expected %04x\n",name,got,expected);
+        failures++;
+        POKE(0xd020U,2);
+    }
+}
+
+// RFC 1071 section 3 example
+unsigned char rfc1071[8]={0x00,0x01,0xf2,0x03,0xf4,0xf5,0xf6,0xf7};
+// IPv4 header with a valid checksum: sums to $ffff
+unsigned char ip_header[20]={0x45,0x00,0x00,0x73,0x00,0x00,0x40,0x00,0x40,0x11,
+                             0xb8,0x61,0xc0,0xa8,0x00,0x01,0xc0,0xa8,0x00,0xc7};
+
+void main() {
+    unsigned short len,ofs,i;
+    unsigned long seed=1;
+#ifdef CHECKSUM_45GS02
+    chks_t c;
+#endif
+
+    POKE(0xd020U,5);
+
+    // Fixed vectors
+    checksum_init();
+    ip_checksum_c(rfc1071,8);
+    check("rfc1071",0xddf2);
+    checksum_init();
+    ip_checksum_c(ip_header,20);
+    check("ip header",0xffff);
+    // Chained calls, as used for the TCP pseudo-header
+    checksum_init();
+    ip_checksum_c(rfc1071,4);
+    ip_checksum_c(&rfc1071[4],4);
+    check("chained",0xddf2);
+    checksum_init();
+    add_checksum(0x0001);
+    add_checksum(0xf203);
+    add_checksum(0xf4f5);
+    add_checksum(0xf6f7);
+    check("add_checksum",0xddf2);
+
+    // Pseudo-random data, including runs of $00 and $ff to exercise carries
+    for(i=0;i<sizeof(data);i++) {
+        seed=seed*1103515245UL+12345UL;
+        data[i]=seed>>16;
+        if ((i&0x30)==0x10) data[i]=0xff;
+        if ((i&0x30)==0x20) data[i]=0x00;
+    }
+
+    for(ofs=0;ofs<4;ofs++) {
+        for(len=0;len<=sizeof(data)-4;len++) {
+            checksum_init();
+            ip_checksum_c(&data[ofs],len);
+            check("c vs reference",ref_checksum(&data[ofs],len));
+#ifdef CHECKSUM_45GS02
+            // Start from a non-zero sum to check chaining as well
+            c.u=0x1234+len;
+            chks.u=c.u;
+            ip_checksum_c(&data[ofs],len);
+            c.u=chks.u;
+            chks.u=0x1234+len;
+            ip_checksum_45gs02(&data[ofs],len);
+            if (chks.u!=c.u) {
+                printf("FAIL 45gs02 ofs=%d len=%d: got %04x, expected %04x\n",
+                       ofs,len,chks.u,c.u);
+                failures++;
+                POKE(0xd020U,2);
+            }
+#endif
+        }
+    }
+
+    printf("checksum tests done, %d failures\n",failures);
+}
@@ -7,7 +7,7 @@ byte_t inc_border(byte_t b) {
     // Incease border color
     POKE(0xd020U,PEEK(0xd020U)+1);
     // Re-schedule task
-    task_add(&inc_border, 45, 7,"border");
+    task_add(&inc_border, 1030, 7, TASK_APP1);
     return 1;
 }
 
@@ -15,17 +15,32 @@ byte_t inc_background(byte_t b) {
     // Incease backgroud color
     POKE(0xd021U,PEEK(0xd021U)+1);
     // Re-schedule task
-    task_add(&inc_background, 72, 10,"background");
+    task_add(&inc_background, 2470, 10, TASK_APP2);
     return 0;
 }
 
 
 void main() {
+    uint32_t start;
+    byte_t frames;
+
     // Init task system
     task_init();
+
+    // The millisecond clock must be running: wait 10 frames (about
+    // 200ms), and stop with a red border if ticks did not move.
+    tick();
+    start=ticks.d;
+    for(frames=0;frames<10;frames++) {
+        while(PEEK(0xd012U)!=0xff) ;
+        while(PEEK(0xd012U)==0xff) ;
+    }
+    tick();
+    if (ticks.d-start<150) for(;;) POKE(0xd020U,2);
+
     // Schedule tasks
-    task_add(&inc_border, 45, 7,"border");
-    task_add(&inc_background, 72, 10,"background");
+    task_add(&inc_border, 1030, 7, TASK_APP1);
+    task_add(&inc_background, 2470, 10, TASK_APP2);
 
     // Run scheduled tasks
     for(;;) {